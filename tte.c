@@ -30,11 +30,15 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
@@ -42,6 +46,22 @@
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+// io_uring is only used if the headers know about it. No library is
+// needed, we talk to the kernel directly.
+#if defined(__has_include) && defined(__NR_io_uring_setup)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define TTE_IO_URING
+#endif
+#endif
+#endif
 
 /*** Define section ***/
 
@@ -56,6 +76,56 @@
 #define TTE_TAB_STOP 4
 // Times to press Ctrl-Q before exiting
 #define TTE_QUIT_TIMES 2
+// Rows shorter than this keep their chars and highlight inside editor_row
+#define TTE_SMALL_ROW 16
+// Rows at least this long are drawn from chunks, without syntax highlighting
+#define TTE_LONG_ROW (1 << 16)
+// Chars per chunk of a long row (they grow up to twice as big on edits)
+#define TTE_ROW_CHUNK 4096
+// Row buffers up to this size come from slabs, bigger ones from malloc()
+#define TTE_SLAB_MAX 4096
+// Bigger row buffers start with their size, in this many bytes
+#define TTE_BIG_HEADER 16
+// Sizes of slab blocks: 16 steps of 16 bytes, then 8 up to TTE_SLAB_MAX
+#define TTE_SLAB_CLASSES 24
+// Slabs are carved out of arenas this big, aligned to their size
+#define TTE_SLAB_ARENA (1 << 20)
+// Rows above and below the screen that idle compaction keeps packed
+#define TTE_COMPACT_ROWS 4096
+// Milliseconds of idle time compaction may take at once
+#define TTE_COMPACT_SLICE_MS 5
+// Lines looked up before deciding if a file repeats enough to intern them
+#define TTE_INTERN_SAMPLE (1 << 16)
+// Bytes of row buffers kept before rows far from the screen are compressed
+#define TTE_COLD_BUDGET ((ssize_t) 1 << 30)
+// Rows compressed together into one cold block
+#define TTE_COLD_ROWS 256
+// Rows above and below the screen that are never compressed
+#define TTE_COLD_DISTANCE 8192
+// Milliseconds of idle time compressing rows may take at once
+#define TTE_COLD_SLICE_MS 10
+// Row metadata flags, see struct row_meta
+#define META_OPEN_COMMENT (1 << 0)
+#define META_LONG (1 << 1)
+#define META_COLD (1 << 2)
+// Milliseconds spent finding all matches of a search between key checks
+#define TTE_SEARCH_SLICE_MS 20
+// Matches of a search kept at most, see struct search_index
+#define TTE_SEARCH_MAX_HITS (1 << 22)
+// Threads looking for matches of a search at most
+#define TTE_SEARCH_THREADS 8
+// Rows each search thread starts with, the batch adapts to the slice time
+#define TTE_SEARCH_BATCH (1 << 14)
+// Batches a slice of a search is cut in per thread, faster threads take more
+#define TTE_SEARCH_QUEUE 4
+// Instructions a compiled regex may have at most
+#define TTE_REGEX_MAX_INSTS 2048
+// DFA states a regex keeps before they are thrown away and built again
+#define TTE_REGEX_DFA_STATES 256
+// Compiled regexes kept for the search prompt
+#define TTE_REGEX_CACHE 8
+// Longest literal a regex is prefiltered with
+#define TTE_REGEX_LITERAL 64
 // Highlight flags
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
@@ -66,19 +136,81 @@
 // Set to -1 for unlimited Undo
 // Set to 0 to disable Undo
 #define ACTIONS_LIST_MAX_SIZE 80
+// Bytes read from the file at once when loading it
+#define TTE_READ_CHUNK (1 << 16)
+// Bytes written to the file at once when saving it
+#define TTE_WRITE_CHUNK (1 << 20)
+// Reads/writes kept in flight at once with io_uring
+#define TTE_IO_DEPTH 4
+// Milliseconds spent loading the file between two checks for keypresses
+#define TTE_LOAD_SLICE_MS 20
+// Screens worth of rows kept in memory by the paged viewer
+#define TTE_PAGER_WINDOW_PAGES 8
+// The paged viewer remembers the offset of one line out of this many
+#define TTE_PAGER_INDEX_STRIDE 1024
+// Scans in -R mode give the pages back to the kernel every this many bytes
+#define TTE_PAGER_DROP_BYTES (1 << 24)
+// Index entries the paged viewer goes back to find the comment state
+#define TTE_PAGER_HL_LOOKBACK 4
+// Files smaller than this are not worth keeping in the index cache
+#define TTE_CACHE_MIN_SIZE (1 << 24)
+// Blocks of the file hashed to tell if a cache entry still matches it
+#define TTE_CACHE_SAMPLES 16
+#define TTE_CACHE_SAMPLE_SIZE 4096
 
 typedef struct ActionList ActionList;
 
+typedef struct editor_loader editor_loader;
+
 /*** Data section ***/
 
+// Long rows (see TTE_LONG_ROW) are not rendered as a whole. Their chars
+// are split into chunks that know how wide they are on screen, so only
+// the chunks around the cursor and col_offset are ever looked at. The
+// chunks only index the chars, which are still one buffer: an edit in a
+// long row moves everything after it, like in any other row. Long rows
+// have no highlight, only the matches of a search are shown in them.
+struct row_chunk {
+    ssize_t len; // Chars in the chunk.
+    ssize_t pre; // Chars before the first tab, len if there's none.
+    ssize_t post; // Columns after the first tab, counted from a tab stop.
+    // Checkpoints, only valid for the first row.chunks_valid chunks.
+    ssize_t x; // Index of its first char in chars.
+    ssize_t rx; // Column where it starts on screen.
+};
+
 typedef struct editor_row {
-    int idx; // Row own index within the file.
-    int size; // Size of the content (excluding NULL term)
-    int render_size; // Size of the rendered content
+    ssize_t idx; // Row own index within the file.
+    ssize_t size; // Size of the content (excluding NULL term)
+    ssize_t render_size; // Size of the rendered content
     char* chars; // Row content
-    char* render; // Row content "rendered" for screen (for TABs).
+    char* render; // Row content "rendered" for screen (for TABs). NULL for long rows.
     unsigned char* highlight; // This will tell you if a character is part of a string, comment, number...
-    int hl_open_comment; // True if the line is part of a ML comment.
+    unsigned render_alias : 1; // True if render is chars itself (there are no TABs).
+    unsigned hl_open_comment : 1; // True if the line is part of a ML comment.
+    unsigned chars_inline : 1; // True if chars is u.small.chars.
+    unsigned highlight_inline : 1; // True if highlight is u.small.highlight.
+    unsigned chars_shared : 1; // True if chars is an interned line, see rowIntern().
+    unsigned cold : 1; // True if the row is compressed, see editorRowThaw().
+    struct row_chunk* chunks; // Only for long rows, NULL otherwise.
+    union {
+        // Only used while chunks is set.
+        struct {
+            ssize_t num_chunks;
+            ssize_t chunks_valid; // Chunks whose x and rx are up to date.
+        } big;
+        // Short rows don't need any malloc(), see editorRowRelink().
+        struct {
+            char chars[TTE_SMALL_ROW];
+            unsigned char highlight[TTE_SMALL_ROW];
+        } small;
+        // Cold rows, their chars are at `offset` once the block is
+        // decompressed.
+        struct {
+            struct cold_block* block;
+            size_t offset;
+        } cold;
+    } u;
 } editor_row;
 
 struct editor_syntax {
@@ -104,18 +236,180 @@ struct editor_syntax {
     int flags;
 };
 
+// Read-only paged viewer (-R). Only a window of the file is kept in
+// ec.row, everything else is reached through a sparse line index that
+// grows as the file is explored.
+struct editor_pager {
+    FILE* file;
+    off_t* index; // index[k] is the offset of line k * TTE_PAGER_INDEX_STRIDE.
+    signed char* hl_state; // 1 if that line starts inside a ML comment, 0 if not, -1 unknown.
+    int index_len;
+    int index_cap;
+    ssize_t scan_line; // Lines are indexed up to this one...
+    off_t scan_offset; // ...which starts at this offset.
+    ssize_t total_lines; // -1 until the end of the file is found.
+    off_t window_start; // Bytes of the file currently loaded into rows.
+    off_t window_end;
+};
+
+// What we learn about a big file (where its lines start, multi-line
+// comment state, where the cursor was) is kept in a cache directory when
+// tte exits, so opening it again doesn't have to find it all out again.
+// The entry is only used if the file still looks the same: same inode,
+// size and mtime, and the same bytes at a few places spread over it.
+struct cache_header {
+    char magic[8];
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t sample_hash;
+    int64_t cursor_line;
+    int64_t cursor_x;
+    int64_t top_line;
+    int64_t total_lines; // -1 if unknown.
+    int64_t scan_line;
+    int64_t scan_offset;
+    int64_t index_len; // Followed by the index offsets and hl states.
+};
+
+// Rows far from the screen can be compressed together, see the Cold
+// storage section. Their chars are followed by a '\0' in `data` once
+// it's decompressed.
+struct cold_block {
+    char* data;
+    size_t len;
+    size_t raw_len;
+    ssize_t rows; // Rows still in it.
+};
+
+// A cold block decompressed to be read, see coldViewText().
+struct cold_view {
+    struct cold_block* cached; // Block decompressed in `raw`.
+    char* raw;
+    size_t raw_cap;
+};
+
+struct editor_cold {
+    ssize_t budget; // Bytes of row buffers allowed before rows are compressed.
+    ssize_t next_y; // Where the next sweep goes on.
+    struct cold_view view; // The one editorRowText() uses.
+    ssize_t bytes; // Compressed bytes in all blocks.
+};
+
+// Row buffers (chars, render, highlight) are taken from arenas holding
+// blocks of a single size, see the Row memory section. Each arena is
+// aligned to its size, so the arena of a block is found from its address.
+struct slab_arena {
+    char* base;
+    int size_class;
+    ssize_t used; // Bytes of its blocks in use, see slabRelease().
+};
+
+// Identical lines share one copy of their chars, counted in `refs`.
+struct interned_line {
+    char* text;
+    uint32_t hash;
+    uint32_t size;
+    ssize_t refs;
+};
+
+struct row_slabs {
+    struct slab_arena* arenas; // Sorted by base.
+    ssize_t num_arenas;
+    char* next[TTE_SLAB_CLASSES]; // Free space in the last arena of each class.
+    char* end[TTE_SLAB_CLASSES];
+    void* free_list[TTE_SLAB_CLASSES]; // Freed blocks, linked through their first bytes.
+    ssize_t num_big; // Row buffers from malloc() still in use.
+    ssize_t big_bytes; // And their bytes.
+    ssize_t live; // Bytes of slab blocks in use.
+    // Idle compaction, see editorCompact().
+    ssize_t compact_y; // Next row to look at, done once it reaches compact_end.
+    ssize_t compact_end;
+    ssize_t compact_offset; // row_offset and dirty when the pass started.
+    ssize_t compact_dirty;
+    char* placed[TTE_SLAB_CLASSES]; // End of the last block the pass kept.
+    // Interned lines, open addressing with linear probing.
+    struct interned_line* lines;
+    ssize_t lines_cap; // Power of two.
+    ssize_t num_lines;
+    ssize_t intern_tries; // Lines looked up, and how many were found.
+    ssize_t intern_hits;
+    unsigned intern_off : 1; // 1 once the file turned out not to repeat.
+};
+
+// What sweeps over the whole file need from each row, kept out of
+// editor_row in dense arrays so they don't have to walk the rows. Only
+// the first `valid` entries are up to date, see editorMetaUpdate().
+struct row_meta {
+    ssize_t* size; // editor_row.size
+    unsigned char* flags; // META_* flags.
+    uint32_t* version; // Changes whenever the row does.
+    ssize_t valid;
+    ssize_t cap;
+    uint32_t clock; // Last version handed out.
+    // Fenwick tree of the bytes of the first `valid` rows (newline
+    // included), 1-based. Only while bytes_valid, see editorMetaBytes().
+    ssize_t* bytes;
+    ssize_t bytes_cap;
+    unsigned bytes_valid : 1;
+};
+
+struct search_hit {
+    ssize_t y;
+    ssize_t x; // In chars.
+    ssize_t len; // In chars, regex matches differ in length.
+};
+
+// Every match of the query in the search prompt, in order. They are
+// found a slice at a time while the prompt waits for keys.
+struct search_index {
+    char* query; // NULL if there's none.
+    struct search_hit* hits;
+    ssize_t num_hits;
+    ssize_t cap;
+    ssize_t next_y; // Next row to look at.
+    ssize_t batch; // Rows per thread at once, see searchIndexParallel().
+    struct search_pool* pool; // Threads looking for matches, NULL if there are none.
+    ssize_t match_y; // The match the cursor is on, -1 if there's none.
+    ssize_t match_x;
+    unsigned done : 1;
+    unsigned full : 1; // 1 if there were too many to keep them all.
+    unsigned regex : 1; // The query is a regex, toggled with Ctrl-R.
+    unsigned bad : 1; // The query is a regex that doesn't compile.
+};
+
 struct editor_config {
-    int cursor_x;
-    int cursor_y;
-    int render_x;
-    int row_offset; // Offset of row displayed.
-    int col_offset; // Offset of col displayed.
+    ssize_t cursor_x;
+    ssize_t cursor_y;
+    ssize_t render_x;
+    ssize_t row_offset; // Offset of row displayed.
+    ssize_t col_offset; // Offset of col displayed.
     int screen_rows; // Number of rows that we can show
     int screen_cols; // Number of cols that we can show
-    int num_rows; // Number of rows
+    ssize_t num_rows; // Number of rows
+    ssize_t row_base; // Line number of ec.row[0] within the file, -1 if unknown.
+    int hl_base_open; // True if ec.row[0] starts inside a ML comment.
     editor_row* row;
-    int dirty; // To know if a file has been modified since opening.
+    ssize_t row_cap; // Rows allocated in ec.row.
+    struct row_meta meta;
+    ssize_t dirty; // To know if a file has been modified since opening.
     unsigned use_tabs : 1; // 1 means use tabs as tabs, 0 means spaces
+    unsigned follow : 1; // 1 means load lines appended to the file (-f)
+    unsigned open_at_end : 1; // 1 means start at the end of the file (+G)
+    int row_open; // True if the last row had no newline when it was loaded.
+    off_t file_offset; // Bytes of the file already loaded into rows.
+    int watch_fd; // inotify descriptor for the open file, -1 if none.
+    struct stat file_stat; // State of the file when rows were last synced with it.
+    editor_loader* loader; // Not NULL while the file is still being loaded.
+    unsigned in_prompt : 1; // 1 while editorPrompt() is reading input.
+    unsigned read_only : 1; // 1 means paged read-only viewer (-R)
+    struct editor_pager pager;
+    struct row_slabs slabs;
+    struct editor_cold cold;
+    struct search_index search;
+    ssize_t max_memory; // --max-memory in bytes, 0 if there's no limit.
+    unsigned memory_full : 1; // 1 while edits that take memory are refused.
     char* file_name;
     char extension[10];
     char status_msg[80];
@@ -131,7 +425,7 @@ struct editor_config {
 // a lot of write's.
 struct a_buf {
     char* buf;
-    int len;
+    ssize_t len;
 };
 
 enum editor_key {
@@ -412,10 +706,46 @@ void abufAppend();
 
 char *editorPrompt(char* prompt, void (*callback)(char*, int));
 
-void editorRowAppendString(editor_row* row, char* s, size_t len);
+int editorRowAppendString(editor_row* row, char* s, size_t len);
+
+int editorRowReserveHighlight(editor_row* row);
+
+uint64_t editorHashLine(const char* s, ssize_t len);
+
+int editorRowThaw(editor_row* row);
 
 void editorInsertNewline();
 
+int editorIdle();
+
+void editorLoadSlice();
+
+void editorSearchIndexSlice();
+
+void editorColdSweep();
+
+void editorMemoryFull();
+
+void searchPoolStop();
+
+void editorRowMeta(editor_row* row);
+
+void editorMemoryCheck();
+
+void editorFreeRow(editor_row* row);
+
+ssize_t editorMemoryUsed();
+
+void editorMemoryPager();
+
+void editorWatchStart();
+
+void remapActions(ssize_t* old_to_new, ssize_t old_num_rows);
+
+int editorCacheLoad(int fd, struct cache_header* header, off_t** index, signed char** hl_state);
+
+void editorCacheStore();
+
 /*** Terminal section ***/
 
 void die(const char* s) {
@@ -475,10 +805,35 @@ void enableRawMode() {
 int editorReadKey() {
     int nread;
     char c;
+    // While the file is loading, the next slice of it is loaded every
+    // time we find there's no key waiting to be read.
+    while (ec.loader) {
+        struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+        if (poll(&pfd, 1, 0) != 0)
+            break;
+        editorLoadSlice();
+        if (!ec.in_prompt) {
+            editorColdSweep();
+            editorMemoryCheck();
+        }
+        editorRefreshScreen();
+    }
+    // Same with the matches of a search, while its prompt waits.
+    while (ec.search.query && !ec.search.done) {
+        struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+        if (poll(&pfd, 1, 0) != 0)
+            break;
+        editorSearchIndexSlice();
+        editorRefreshScreen();
+    }
     while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
         // Ignoring EAGAIN to make it work on Cygwin.
         if (nread == -1 && errno != EAGAIN)
             die("Error reading input");
+        // Nothing was typed during the last 1/10 of a second, so we
+        // use that time for background work (like following the file).
+        if (editorIdle())
+            editorRefreshScreen();
     }
 
     // Check escape sequences, if first byte
@@ -618,15 +973,36 @@ int isAlsoNumber(int c) {
     return c == '.' || c == 'x' || c == 'a' || c == 'b' || c == 'c' || c == 'd' || c == 'e' || c == 'f';
 }
 
-void editorUpdateSyntax(editor_row* row) {
-    row -> highlight = realloc(row -> highlight, row -> render_size);
+// Returns -1 if there's no memory for the highlight of a row, it's then
+// drawn without it.
+int editorUpdateSyntax(editor_row* row) {
+    // Thawing it updates it.
+    if (row -> cold)
+        return editorRowThaw(row);
+    // Long rows aren't highlighted, a ML comment goes on through them.
+    if (row -> chunks) {
+        int in_comment = row -> idx > 0 ? ec.row[row -> idx - 1].hl_open_comment : ec.hl_base_open;
+        int changed = row -> hl_open_comment != in_comment;
+        row -> hl_open_comment = in_comment;
+        editorRowMeta(row);
+        if (changed && row -> idx + 1 < ec.num_rows)
+            return editorUpdateSyntax(&ec.row[row -> idx + 1]);
+        return 0;
+    }
+
+    if (editorRowReserveHighlight(row) == -1) {
+        editorRowMeta(row);
+        return -1;
+    }
     // void * memset ( void * ptr, int value, size_t num );
     // Sets the first num bytes of the block of memory pointed by ptr to
     // the specified value. With this we set all characters to HL_NORMAL.
     memset(row -> highlight, HL_NORMAL, row -> render_size);
 
-    if (ec.syntax == NULL)
-        return;
+    if (ec.syntax == NULL) {
+        editorRowMeta(row);
+        return 0;
+    }
 
     char** keywords = ec.syntax -> keywords;
 
@@ -640,9 +1016,9 @@ void editorUpdateSyntax(editor_row* row) {
 
     int prev_sep = 1; // True (1) if the previous char is a separator, false otherwise.
     int in_string = 0; // If != 0, inside a string. We also keep track if it's ' or "
-    int in_comment = (row -> idx > 0 && ec.row[row -> idx - 1].hl_open_comment); // This is ONLY used on ML comments.
+    int in_comment = (row -> idx > 0 ? ec.row[row -> idx - 1].hl_open_comment : ec.hl_base_open); // This is ONLY used on ML comments.
 
-    int i = 0;
+    ssize_t i = 0;
     while (i < row -> render_size) {
         char c = row -> render[i];
         // Highlight type of the previous character.
@@ -763,8 +1139,10 @@ void editorUpdateSyntax(editor_row* row) {
     // line, the change will continue to propagate to more and more lines
     // until one of them is unchanged, at which point we know that all
     // the lines after that one must be unchanged as well.
+    editorRowMeta(row);
     if (changed && row -> idx + 1 < ec.num_rows)
-        editorUpdateSyntax(&ec.row[row -> idx + 1]);
+        return editorUpdateSyntax(&ec.row[row -> idx + 1]);
+    return 0;
 }
 
 int editorSyntaxToColor(int highlight) {
@@ -787,9 +1165,10 @@ void editorApplySyntaxHighlight() {
     if (ec.syntax == NULL)
         return;
 
-    int file_row;
+    ssize_t file_row;
     for (file_row = 0; file_row < ec.num_rows; file_row++) {
-        editorUpdateSyntax(&ec.row[file_row]);
+        if (editorUpdateSyntax(&ec.row[file_row]) == -1)
+            editorMemoryFull();
     }
 }
 
@@ -824,11 +1203,856 @@ void editorSelectSyntaxHighlight() {
     }
 }
 
+/*** Row memory section ***/
+
+size_t slabClassSize(int size_class) {
+    if (size_class < 16)
+        return (size_class + 1) * 16;
+    // 384, 512, 768, 1024... Every other class doubles.
+    int k = size_class - 16;
+    return (size_t) (k % 2 ? 512 : 384) << (k / 2);
+}
+
+int slabClass(size_t size) {
+    if (size <= 256)
+        return size ? (size + 15) / 16 - 1 : 0;
+    int size_class = 16;
+    while (slabClassSize(size_class) < size)
+        size_class++;
+    return size_class;
+}
+
+// Returns the arena `ptr` is in, NULL if it's not from a slab.
+struct slab_arena* slabArenaOf(const void* ptr) {
+    char* base = (char*) ((uintptr_t) ptr & ~(uintptr_t) (TTE_SLAB_ARENA - 1));
+    ssize_t lo = 0;
+    ssize_t hi = ec.slabs.num_arenas - 1;
+    while (lo <= hi) {
+        ssize_t mid = lo + (hi - lo) / 2;
+        if (ec.slabs.arenas[mid].base == base)
+            return &ec.slabs.arenas[mid];
+        if (ec.slabs.arenas[mid].base < base)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return NULL;
+}
+
+// Takes a block from the free space of the newest arena of the class.
+void* slabBump(int size_class) {
+    struct row_slabs* sl = &ec.slabs;
+    size_t block = slabClassSize(size_class);
+    if (sl -> next[size_class] == NULL || sl -> next[size_class] + block > sl -> end[size_class]) {
+        void* base;
+        if (posix_memalign(&base, TTE_SLAB_ARENA, TTE_SLAB_ARENA) != 0)
+            return NULL;
+        ssize_t at = sl -> num_arenas;
+        while (at > 0 && sl -> arenas[at - 1].base > (char*) base)
+            at--;
+        sl -> arenas = realloc(sl -> arenas, sizeof(struct slab_arena) * (sl -> num_arenas + 1));
+        memmove(&sl -> arenas[at + 1], &sl -> arenas[at], sizeof(struct slab_arena) * (sl -> num_arenas - at));
+        sl -> arenas[at].base = base;
+        sl -> arenas[at].size_class = size_class;
+        sl -> arenas[at].used = 0;
+        sl -> num_arenas++;
+        sl -> next[size_class] = base;
+        sl -> end[size_class] = (char*) base + TTE_SLAB_ARENA;
+    }
+    void* ptr = sl -> next[size_class];
+    sl -> next[size_class] += block;
+    return ptr;
+}
+
+// Returns NULL if there's no memory left, like malloc().
+void* rowAlloc(size_t size) {
+    struct row_slabs* sl = &ec.slabs;
+    if (size > TTE_SLAB_MAX) {
+        char* block = malloc(size + TTE_BIG_HEADER);
+        if (block == NULL)
+            return NULL;
+        memcpy(block, &size, sizeof(size_t));
+        sl -> num_big++;
+        sl -> big_bytes += size;
+        return block + TTE_BIG_HEADER;
+    }
+    int size_class = slabClass(size);
+    void* ptr = sl -> free_list[size_class];
+    if (ptr)
+        memcpy(&sl -> free_list[size_class], ptr, sizeof(void*));
+    else if ((ptr = slabBump(size_class)) == NULL)
+        return NULL;
+    sl -> live += slabClassSize(size_class);
+    slabArenaOf(ptr) -> used += slabClassSize(size_class);
+    return ptr;
+}
+
+void rowFree(void* ptr) {
+    if (ptr == NULL)
+        return;
+    struct slab_arena* arena = slabArenaOf(ptr);
+    if (arena == NULL) {
+        char* block = (char*) ptr - TTE_BIG_HEADER;
+        size_t size;
+        memcpy(&size, block, sizeof(size_t));
+        ec.slabs.num_big--;
+        ec.slabs.big_bytes -= size;
+        free(block);
+        return;
+    }
+    memcpy(ptr, &ec.slabs.free_list[arena -> size_class], sizeof(void*));
+    ec.slabs.free_list[arena -> size_class] = ptr;
+    ec.slabs.live -= slabClassSize(arena -> size_class);
+    arena -> used -= slabClassSize(arena -> size_class);
+}
+
+// Gives the arenas with no block in use back to the system, all but the
+// one each class is taking new blocks from. Their blocks are taken out
+// of the free lists first.
+void slabRelease(void) {
+    struct row_slabs* sl = &ec.slabs;
+    int found = 0;
+    for (ssize_t j = 0; j < sl -> num_arenas; j++) {
+        struct slab_arena* arena = &sl -> arenas[j];
+        if (arena -> used == 0 && sl -> end[arena -> size_class] != arena -> base + TTE_SLAB_ARENA) {
+            // Marked to be released.
+            arena -> used = -1;
+            found = 1;
+        }
+    }
+    if (!found)
+        return;
+    for (int size_class = 0; size_class < TTE_SLAB_CLASSES; size_class++) {
+        char* prev = NULL;
+        void* ptr = sl -> free_list[size_class];
+        while (ptr) {
+            void* next;
+            memcpy(&next, ptr, sizeof(void*));
+            if (slabArenaOf(ptr) -> used != -1)
+                prev = ptr;
+            else if (prev)
+                memcpy(prev, &next, sizeof(void*));
+            else
+                sl -> free_list[size_class] = next;
+            ptr = next;
+        }
+    }
+    ssize_t kept = 0;
+    for (ssize_t j = 0; j < sl -> num_arenas; j++) {
+        struct slab_arena* arena = &sl -> arenas[j];
+        if (arena -> used != -1) {
+            sl -> arenas[kept++] = *arena;
+            continue;
+        }
+        // free() may keep the memory for malloc() to reuse, the pages
+        // are dropped anyway.
+        madvise(arena -> base, TTE_SLAB_ARENA, MADV_DONTNEED);
+        free(arena -> base);
+    }
+    sl -> num_arenas = kept;
+}
+
+void* rowRealloc(void* ptr, size_t size) {
+    if (ptr == NULL)
+        return rowAlloc(size);
+    struct slab_arena* arena = slabArenaOf(ptr);
+    if (arena == NULL && size > TTE_SLAB_MAX) {
+        size_t old_size;
+        memcpy(&old_size, (char*) ptr - TTE_BIG_HEADER, sizeof(size_t));
+        char* block = realloc((char*) ptr - TTE_BIG_HEADER, size + TTE_BIG_HEADER);
+        if (block == NULL)
+            return NULL;
+        memcpy(block, &size, sizeof(size_t));
+        ec.slabs.big_bytes += size - old_size;
+        return block + TTE_BIG_HEADER;
+    }
+    // A block only changes when its size class does.
+    if (arena && size <= TTE_SLAB_MAX && slabClass(size) == arena -> size_class)
+        return ptr;
+    // Big blocks are always bigger than slab blocks.
+    size_t old_size = arena ? slabClassSize(arena -> size_class) : size;
+    void* new_ptr = rowAlloc(size);
+    if (new_ptr == NULL)
+        return NULL;
+    memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+    rowFree(ptr);
+    return new_ptr;
+}
+
+// Used by idle compaction: the block is trimmed to `size` and moved
+// right after the one kept before it, if it's not already there. The
+// first one of each class in a pass stays where it is.
+void* rowCompactBlock(void* ptr, size_t size) {
+    struct slab_arena* arena = slabArenaOf(ptr);
+    if (arena == NULL)
+        return rowRealloc(ptr, size);
+    struct row_slabs* sl = &ec.slabs;
+    int size_class = slabClass(size);
+    size_t block = slabClassSize(size_class);
+    if (size_class == arena -> size_class &&
+        (sl -> placed[size_class] == NULL || sl -> placed[size_class] == ptr)) {
+        sl -> placed[size_class] = (char*) ptr + block;
+        return ptr;
+    }
+    // slabBump() may move the arenas, and `arena` with them.
+    size_t old_size = slabClassSize(arena -> size_class);
+    char* new_ptr = slabBump(size_class);
+    if (new_ptr == NULL)
+        return ptr;
+    sl -> live += block;
+    slabArenaOf(new_ptr) -> used += block;
+    memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+    rowFree(ptr);
+    sl -> placed[size_class] = new_ptr + block;
+    return new_ptr;
+}
+
+// Returns -1 (and the table is left as it was) if there's no memory.
+int internGrow() {
+    struct row_slabs* sl = &ec.slabs;
+    ssize_t old_cap = sl -> lines_cap;
+    struct interned_line* old_lines = sl -> lines;
+    struct interned_line* lines = calloc(old_cap ? old_cap * 2 : 1024, sizeof(struct interned_line));
+    if (lines == NULL)
+        return -1;
+    sl -> lines_cap = old_cap ? old_cap * 2 : 1024;
+    sl -> lines = lines;
+    for (ssize_t j = 0; j < old_cap; j++) {
+        if (old_lines[j].text == NULL)
+            continue;
+        ssize_t k = old_lines[j].hash & (sl -> lines_cap - 1);
+        while (sl -> lines[k].text)
+            k = (k + 1) & (sl -> lines_cap - 1);
+        sl -> lines[k] = old_lines[j];
+    }
+    free(old_lines);
+    return 0;
+}
+
+// Returns the shared copy of the line, made if it's the first one. It
+// must be left as it is and given back with rowRelease(). Returns NULL
+// if the file doesn't repeat its lines often enough to be worth it, or
+// if there's no memory for it.
+char* rowIntern(const char* s, ssize_t len) {
+    struct row_slabs* sl = &ec.slabs;
+    if (sl -> intern_off)
+        return NULL;
+    if (sl -> intern_tries == TTE_INTERN_SAMPLE && sl -> intern_hits < TTE_INTERN_SAMPLE / 8) {
+        sl -> intern_off = 1;
+        return NULL;
+    }
+    if ((sl -> num_lines + 1) * 4 > sl -> lines_cap * 3 && internGrow() == -1)
+        return NULL;
+    uint32_t hash = editorHashLine(s, len);
+    ssize_t k = hash & (sl -> lines_cap - 1);
+    sl -> intern_tries++;
+    while (sl -> lines[k].text) {
+        struct interned_line* line = &sl -> lines[k];
+        if (line -> hash == hash && line -> size == len && memcmp(line -> text, s, len) == 0) {
+            sl -> intern_hits++;
+            line -> refs++;
+            return line -> text;
+        }
+        k = (k + 1) & (sl -> lines_cap - 1);
+    }
+    struct interned_line* line = &sl -> lines[k];
+    if ((line -> text = rowAlloc(len + 1)) == NULL)
+        return NULL;
+    memcpy(line -> text, s, len);
+    line -> text[len] = '\0';
+    line -> hash = hash;
+    line -> size = len;
+    line -> refs = 1;
+    sl -> num_lines++;
+    return line -> text;
+}
+
+void rowRelease(char* text, ssize_t len) {
+    struct row_slabs* sl = &ec.slabs;
+    ssize_t mask = sl -> lines_cap - 1;
+    ssize_t k = (uint32_t) editorHashLine(text, len) & mask;
+    while (sl -> lines[k].text != text)
+        k = (k + 1) & mask;
+    if (--sl -> lines[k].refs > 0)
+        return;
+    rowFree(text);
+    sl -> num_lines--;
+    // Entries after it that would be found sooner without the hole are
+    // moved back into it.
+    ssize_t hole = k;
+    for (ssize_t j = (k + 1) & mask; sl -> lines[j].text; j = (j + 1) & mask) {
+        ssize_t home = sl -> lines[j].hash & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            sl -> lines[hole] = sl -> lines[j];
+            hole = j;
+        }
+    }
+    sl -> lines[hole].text = NULL;
+}
+
+// Gives every arena back at once. Only to be called when no row is left.
+void rowFreeAll(void) {
+    struct row_slabs* sl = &ec.slabs;
+    for (ssize_t j = 0; j < sl -> num_arenas; j++)
+        free(sl -> arenas[j].base);
+    free(sl -> arenas);
+    free(sl -> lines);
+    memset(sl, 0, sizeof(struct row_slabs));
+}
+
+/*** Cold storage section ***/
+
+// A small LZ77 compressor in the spirit of LZ4. Sequences are a token
+// (literal length << 4 | match length - 4, 15 meaning more length bytes
+// follow), the literals, and for all but the last one a 2 byte offset.
+size_t lzBound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+static void lzPutLength(unsigned char** out, size_t len) {
+    for (; len >= 255; len -= 255)
+        *(*out)++ = 255;
+    *(*out)++ = len;
+}
+
+static void lzPutSequence(unsigned char** out, const char* lit, size_t lit_len, size_t offset, size_t match_len) {
+    unsigned char* token = (*out)++;
+    *token = (lit_len < 15 ? lit_len : 15) << 4;
+    if (lit_len >= 15)
+        lzPutLength(out, lit_len - 15);
+    memcpy(*out, lit, lit_len);
+    *out += lit_len;
+    if (match_len == 0)
+        return;
+    *(*out)++ = offset & 0xff;
+    *(*out)++ = offset >> 8;
+    *token |= match_len - 4 < 15 ? match_len - 4 : 15;
+    if (match_len - 4 >= 15)
+        lzPutLength(out, match_len - 4 - 15);
+}
+
+// dst must have room for lzBound(len) bytes. Returns the compressed size.
+size_t lzCompress(const char* src, size_t len, char* dst) {
+    uint32_t table[4096] = {0}; // Last position + 1 of each hashed 4 bytes.
+    unsigned char* out = (unsigned char*) dst;
+    size_t anchor = 0;
+    size_t ip = 0;
+    while (ip + 4 <= len) {
+        uint32_t seq;
+        memcpy(&seq, &src[ip], 4);
+        uint32_t h = (seq * 2654435761u) >> 20;
+        size_t ref = table[h];
+        table[h] = ip + 1;
+        if (ref == 0 || ip - (ref - 1) > 0xffff || memcmp(&src[ref - 1], &src[ip], 4) != 0) {
+            ip++;
+            continue;
+        }
+        ref--;
+        size_t match_len = 4;
+        while (ip + match_len < len && src[ref + match_len] == src[ip + match_len])
+            match_len++;
+        lzPutSequence(&out, &src[anchor], ip - anchor, ip - ref, match_len);
+        ip += match_len;
+        anchor = ip;
+    }
+    lzPutSequence(&out, &src[anchor], len - anchor, 0, 0);
+    return out - (unsigned char*) dst;
+}
+
+static size_t lzGetLength(const unsigned char** in) {
+    size_t len = 0;
+    unsigned char c;
+    do {
+        c = *(*in)++;
+        len += c;
+    } while (c == 255);
+    return len;
+}
+
+void lzDecompress(const char* src, size_t len, char* dst) {
+    const unsigned char* in = (const unsigned char*) src;
+    const unsigned char* end = in + len;
+    char* out = dst;
+    while (in < end) {
+        unsigned char token = *in++;
+        size_t lit_len = token >> 4;
+        if (lit_len == 15)
+            lit_len += lzGetLength(&in);
+        memcpy(out, in, lit_len);
+        out += lit_len;
+        in += lit_len;
+        if (in >= end)
+            break;
+        size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        size_t match_len = (token & 15) + 4;
+        if ((token & 15) == 15)
+            match_len += lzGetLength(&in);
+        // Matches may overlap what they write.
+        for (size_t j = 0; j < match_len; j++, out++)
+            *out = *(out - offset);
+    }
+}
+
+void coldRelease(struct cold_block* block) {
+    if (--block -> rows > 0)
+        return;
+    if (ec.cold.view.cached == block)
+        ec.cold.view.cached = NULL;
+    ec.cold.bytes -= block -> len;
+    free(block -> data);
+    free(block);
+}
+
+// The chars of a cold row, decompressing its block into the view if it's
+// not the one already there. Each thread reading cold rows has its own.
+const char* coldViewText(struct cold_view* view, editor_row* row) {
+    struct cold_block* block = row -> u.cold.block;
+    if (view -> cached != block) {
+        if (view -> raw_cap < block -> raw_len) {
+            view -> raw_cap = block -> raw_len;
+            free(view -> raw);
+            view -> raw = malloc(view -> raw_cap);
+        }
+        lzDecompress(block -> data, block -> len, view -> raw);
+        view -> cached = block;
+    }
+    return view -> raw + row -> u.cold.offset;
+}
+
+// The chars of a row, cold or not. For cold rows they are only good
+// until another block is decompressed.
+const char* editorRowText(editor_row* row) {
+    if (!row -> cold)
+        return row -> chars;
+    return coldViewText(&ec.cold.view, row);
+}
+
+/*** Row metadata section ***/
+
+// Makes room for metadata of `rows` rows. Returns -1 if there's no memory
+// for it.
+int editorMetaReserve(ssize_t rows) {
+    struct row_meta* meta = &ec.meta;
+    if (rows <= meta -> cap)
+        return 0;
+    ssize_t cap = meta -> cap * 2 > rows ? meta -> cap * 2 : rows + 64;
+    ssize_t* size = realloc(meta -> size, sizeof(ssize_t) * cap);
+    if (size == NULL)
+        return -1;
+    meta -> size = size;
+    unsigned char* flags = realloc(meta -> flags, cap);
+    if (flags == NULL)
+        return -1;
+    meta -> flags = flags;
+    uint32_t* version = realloc(meta -> version, sizeof(uint32_t) * cap);
+    if (version == NULL)
+        return -1;
+    meta -> version = version;
+    meta -> cap = cap;
+    return 0;
+}
+
+void editorMetaSet(ssize_t y) {
+    editor_row* row = &ec.row[y];
+    ec.meta.size[y] = row -> size;
+    ec.meta.flags[y] = (row -> hl_open_comment ? META_OPEN_COMMENT : 0) |
+        (row -> chunks ? META_LONG : 0) | (row -> cold ? META_COLD : 0);
+    ec.meta.version[y] = ++ec.meta.clock;
+}
+
+// Called whenever a row changes. Rows that aren't in ec.row (yet) have
+// no metadata.
+void editorRowMeta(editor_row* row) {
+    struct row_meta* meta = &ec.meta;
+    ssize_t y = row -> idx;
+    if (y >= meta -> valid || &ec.row[y] != row)
+        return;
+    ssize_t delta = row -> size - meta -> size[y];
+    editorMetaSet(y);
+    // An edit within the row only changes the sums above it.
+    for (ssize_t j = y + 1; meta -> bytes_valid && delta && j <= meta -> valid; j += j & -j)
+        meta -> bytes[j] += delta;
+}
+
+// Metadata from row `from` on has to be looked at again.
+void editorMetaInvalidate(ssize_t from) {
+    if (ec.meta.valid > from)
+        ec.meta.valid = from;
+    ec.meta.bytes_valid = 0;
+}
+
+// Brings the metadata up to date with ec.row. Returns -1 if there's no
+// memory for it.
+int editorMetaUpdate() {
+    if (editorMetaReserve(ec.num_rows) == -1)
+        return -1;
+    for (ssize_t y = ec.meta.valid; y < ec.num_rows; y++)
+        editorMetaSet(y);
+    ec.meta.valid = ec.num_rows;
+    return 0;
+}
+
+void editorMetaInsert(ssize_t at) {
+    struct row_meta* meta = &ec.meta;
+    // Nothing to keep until a sweep asked for it.
+    if (at > meta -> valid || meta -> cap == 0)
+        return;
+    if (editorMetaReserve(meta -> valid + 1) == -1) {
+        meta -> valid = at;
+        return;
+    }
+    ssize_t moved = meta -> valid - at;
+    memmove(&meta -> size[at + 1], &meta -> size[at], sizeof(ssize_t) * moved);
+    memmove(&meta -> flags[at + 1], &meta -> flags[at], moved);
+    memmove(&meta -> version[at + 1], &meta -> version[at], sizeof(uint32_t) * moved);
+    meta -> valid++;
+    // Rows moving makes the tree be built again, it's linear like the
+    // memmove() of the rows themselves.
+    meta -> bytes_valid = 0;
+}
+
+void editorMetaDelete(ssize_t at) {
+    struct row_meta* meta = &ec.meta;
+    if (at >= meta -> valid)
+        return;
+    ssize_t moved = meta -> valid - at - 1;
+    memmove(&meta -> size[at], &meta -> size[at + 1], sizeof(ssize_t) * moved);
+    memmove(&meta -> flags[at], &meta -> flags[at + 1], moved);
+    memmove(&meta -> version[at], &meta -> version[at + 1], sizeof(uint32_t) * moved);
+    meta -> valid--;
+    meta -> bytes_valid = 0;
+}
+
+// Builds the tree of byte offsets if it has to. Returns -1 if there's no
+// memory for it.
+int editorMetaBytes() {
+    struct row_meta* meta = &ec.meta;
+    if (editorMetaUpdate() == -1)
+        return -1;
+    if (meta -> bytes_valid)
+        return 0;
+    ssize_t n = meta -> valid;
+    if (n + 1 > meta -> bytes_cap) {
+        ssize_t* bytes = realloc(meta -> bytes, sizeof(ssize_t) * (n + 1));
+        if (bytes == NULL)
+            return -1;
+        meta -> bytes = bytes;
+        meta -> bytes_cap = n + 1;
+    }
+    meta -> bytes[0] = 0;
+    for (ssize_t j = 1; j <= n; j++)
+        meta -> bytes[j] = meta -> size[j - 1] + 1;
+    for (ssize_t j = 1; j <= n; j++) {
+        ssize_t parent = j + (j & -j);
+        if (parent <= n)
+            meta -> bytes[parent] += meta -> bytes[j];
+    }
+    meta -> bytes_valid = 1;
+    return 0;
+}
+
+// Byte offset in the file where row y starts, y may be ec.num_rows.
+// Returns -1 if there's no memory to know it.
+ssize_t editorRowOffset(ssize_t y) {
+    if (editorMetaBytes() == -1)
+        return -1;
+    ssize_t offset = 0;
+    for (ssize_t j = y; j > 0; j -= j & -j)
+        offset += ec.meta.bytes[j];
+    return offset;
+}
+
+// Row that has the byte at `offset`, ec.num_rows if it's past the end.
+// Returns -1 if there's no memory to know it.
+ssize_t editorRowAtOffset(ssize_t offset) {
+    if (editorMetaBytes() == -1)
+        return -1;
+    ssize_t n = ec.meta.valid;
+    ssize_t step = 1;
+    while (step * 2 <= n)
+        step *= 2;
+    // Going down the tree: y ends up as the number of rows that end at or
+    // before offset.
+    ssize_t y = 0;
+    for (; step > 0; step /= 2) {
+        if (y + step <= n && ec.meta.bytes[y + step] <= offset) {
+            y += step;
+            offset -= ec.meta.bytes[y];
+        }
+    }
+    return y;
+}
+
 /*** Row operations ***/
 
-int editorRowCursorXToRenderX(editor_row* row, int cursor_x) {
-    int render_x = 0;
-    int j;
+// Short rows keep their chars and highlight inside editor_row, so the
+// pointers to them must be set again every time the row is moved.
+void editorRowRelink(editor_row* row) {
+    if (row -> chars_inline)
+        row -> chars = row -> u.small.chars;
+    if (row -> render_alias)
+        row -> render = row -> chars;
+    if (row -> highlight_inline)
+        row -> highlight = row -> u.small.highlight;
+}
+
+// Gives the row its own copy of an interned line before it's changed.
+// Returns -1 (and the row is left as it was) if there's no memory for it.
+int editorRowUnshare(editor_row* row) {
+    if (editorRowThaw(row) == -1)
+        return -1;
+    if (!row -> chars_shared)
+        return 0;
+    char* chars = rowAlloc(row -> size + 1);
+    if (chars == NULL)
+        return -1;
+    memcpy(chars, row -> chars, row -> size + 1);
+    rowRelease(row -> chars, row -> size);
+    row -> chars = chars;
+    row -> chars_shared = 0;
+    editorRowRelink(row);
+    return 0;
+}
+
+// Makes room for `size` bytes in chars. Returns -1 (and the row is left
+// as it was) if there's no memory for it.
+int editorRowReserve(editor_row* row, ssize_t size) {
+    if (editorRowUnshare(row) == -1)
+        return -1;
+    if (row -> chars == NULL && size <= TTE_SMALL_ROW) {
+        row -> chars_inline = 1;
+    } else if (row -> chars_inline && size > TTE_SMALL_ROW) {
+        char* chars = rowAlloc(size);
+        if (chars == NULL)
+            return -1;
+        memcpy(chars, row -> u.small.chars, row -> size + 1);
+        row -> chars = chars;
+        row -> chars_inline = 0;
+    } else if (!row -> chars_inline) {
+        char* chars = rowRealloc(row -> chars, size);
+        if (chars == NULL)
+            return -1;
+        row -> chars = chars;
+    }
+    editorRowRelink(row);
+    return 0;
+}
+
+// Makes room for render_size bytes in highlight. Returns -1 (and the row
+// is left without one) if there's no memory for it.
+int editorRowReserveHighlight(editor_row* row) {
+    if (row -> render_size <= TTE_SMALL_ROW) {
+        if (!row -> highlight_inline)
+            rowFree(row -> highlight);
+        row -> highlight_inline = 1;
+    } else {
+        if (row -> highlight_inline)
+            row -> highlight = NULL;
+        row -> highlight_inline = 0;
+        unsigned char* highlight = rowRealloc(row -> highlight, row -> render_size);
+        if (highlight == NULL) {
+            rowFree(row -> highlight);
+            row -> highlight = NULL;
+            return -1;
+        }
+        row -> highlight = highlight;
+    }
+    editorRowRelink(row);
+    return 0;
+}
+
+// Repacks the heap buffers of the row, see editorCompact().
+void editorRowCompact(editor_row* row) {
+    if (row -> cold)
+        return;
+    if (!row -> chars_inline && !row -> chars_shared)
+        row -> chars = rowCompactBlock(row -> chars, row -> size + 1);
+    if (row -> render_alias)
+        row -> render = row -> chars;
+    else if (row -> render)
+        row -> render = rowCompactBlock(row -> render, row -> render_size + 1);
+    if (!row -> highlight_inline && row -> highlight)
+        row -> highlight = rowCompactBlock(row -> highlight, row -> render_size);
+}
+
+// Gives the row a copy of s as its chars, they must not be set yet.
+// Returns -1 if there's no memory for it.
+int editorRowSetChars(editor_row* row, const char* s, ssize_t len) {
+    row -> size = 0;
+    row -> chars = NULL;
+    row -> chars_inline = 0;
+    row -> chars_shared = 0;
+    if (len >= TTE_SMALL_ROW && len < TTE_SLAB_MAX)
+        row -> chars = rowIntern(s, len);
+    if (row -> chars) {
+        row -> chars_shared = 1;
+    } else if (editorRowReserve(row, len + 1) == 0) { // We want to add terminator char '\0' at the end
+        memcpy(row -> chars, s, len);
+        row -> chars[len] = '\0';
+    } else {
+        return -1;
+    }
+    row -> size = len;
+    return 0;
+}
+
+int editorRowInit(editor_row* row, ssize_t idx, const char* s, ssize_t len) {
+    row -> idx = idx;
+    row -> chunks = NULL;
+    row -> cold = 0;
+    if (editorRowSetChars(row, s, len) == -1)
+        return -1;
+
+    row -> render_size = 0;
+    row -> render = NULL;
+    row -> render_alias = 0;
+    row -> highlight = NULL;
+    row -> highlight_inline = 0;
+    row -> hl_open_comment = 0;
+    return 0;
+}
+
+void editorRowChunkMeasure(struct row_chunk* chunk, char* s) {
+    char* tab = memchr(s, '\t', chunk -> len);
+    chunk -> pre = tab ? tab - s : chunk -> len;
+    chunk -> post = 0;
+    for (ssize_t j = chunk -> pre + 1; j < chunk -> len; j++) {
+        if (s[j] == '\t')
+            chunk -> post += (TTE_TAB_STOP - 1) - (chunk -> post % TTE_TAB_STOP);
+        chunk -> post++;
+    }
+}
+
+// Column where the chunk ends if it starts at column `col`. After the
+// first tab we are on a tab stop, so the rest is always equally wide.
+ssize_t editorRowChunkEnd(struct row_chunk* chunk, ssize_t col) {
+    if (chunk -> pre == chunk -> len)
+        return col + chunk -> len;
+    return ((col + chunk -> pre) / TTE_TAB_STOP + 1) * TTE_TAB_STOP + chunk -> post;
+}
+
+// Splits the whole row into chunks.
+void editorRowChunkAll(editor_row* row) {
+    row -> u.big.num_chunks = (row -> size + TTE_ROW_CHUNK - 1) / TTE_ROW_CHUNK;
+    row -> chunks = realloc(row -> chunks, sizeof(struct row_chunk) * row -> u.big.num_chunks);
+    row -> u.big.chunks_valid = 0;
+    // Long rows are never rendered as a whole, so they have no size.
+    row -> render_size = 0;
+    for (ssize_t k = 0; k < row -> u.big.num_chunks; k++) {
+        struct row_chunk* chunk = &row -> chunks[k];
+        chunk -> len = k < row -> u.big.num_chunks - 1 ? TTE_ROW_CHUNK : row -> size - k * TTE_ROW_CHUNK;
+        editorRowChunkMeasure(chunk, &row -> chars[k * TTE_ROW_CHUNK]);
+    }
+}
+
+// Makes one more checkpoint valid.
+void editorRowChunkExtend(editor_row* row) {
+    struct row_chunk* chunk = &row -> chunks[row -> u.big.chunks_valid];
+    if (row -> u.big.chunks_valid == 0) {
+        chunk -> x = 0;
+        chunk -> rx = 0;
+    } else {
+        chunk -> x = chunk[-1].x + chunk[-1].len;
+        chunk -> rx = editorRowChunkEnd(&chunk[-1], chunk[-1].rx);
+    }
+    row -> u.big.chunks_valid++;
+}
+
+// Returns the chunk holding the char at `cursor_x` (the last one if it's
+// past the end). Checkpoints are made valid up to there, then it's a
+// binary search.
+ssize_t editorRowChunkAt(editor_row* row, ssize_t cursor_x) {
+    while (row -> u.big.chunks_valid < row -> u.big.num_chunks && (row -> u.big.chunks_valid == 0 ||
+        row -> chunks[row -> u.big.chunks_valid - 1].x + row -> chunks[row -> u.big.chunks_valid - 1].len <= cursor_x))
+        editorRowChunkExtend(row);
+    ssize_t lo = 0;
+    ssize_t hi = row -> u.big.chunks_valid - 1;
+    while (lo < hi) {
+        ssize_t mid = (lo + hi + 1) / 2;
+        if (row -> chunks[mid].x <= cursor_x)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+// Same as editorRowChunkAt(), but for the chunk shown at column `col`.
+ssize_t editorRowChunkAtCol(editor_row* row, ssize_t col) {
+    while (row -> u.big.chunks_valid < row -> u.big.num_chunks && (row -> u.big.chunks_valid == 0 ||
+        editorRowChunkEnd(&row -> chunks[row -> u.big.chunks_valid - 1], row -> chunks[row -> u.big.chunks_valid - 1].rx) <= col))
+        editorRowChunkExtend(row);
+    ssize_t lo = 0;
+    ssize_t hi = row -> u.big.chunks_valid - 1;
+    while (lo < hi) {
+        ssize_t mid = (lo + hi + 1) / 2;
+        if (row -> chunks[mid].rx <= col)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+// A char was inserted (delta 1) or deleted (delta -1) at `at`, only the
+// chunk holding it has to be measured again (the chars after it were
+// already moved by the caller). The checkpoints after it moved, they'll
+// be made valid again when needed.
+void editorRowChunkEdit(editor_row* row, ssize_t at, int delta) {
+    // An insert right at the end of a chunk makes that chunk grow.
+    ssize_t k = editorRowChunkAt(row, delta > 0 && at > 0 ? at - 1 : at);
+    struct row_chunk* chunk = &row -> chunks[k];
+    ssize_t start = chunk -> x;
+    if (row -> u.big.chunks_valid > k + 1)
+        row -> u.big.chunks_valid = k + 1;
+    chunk -> len += delta;
+    if (chunk -> len == 0) {
+        memmove(chunk, chunk + 1, sizeof(struct row_chunk) * (row -> u.big.num_chunks - k - 1));
+        row -> u.big.num_chunks--;
+        row -> u.big.chunks_valid = k;
+    } else if (chunk -> len > 2 * TTE_ROW_CHUNK) {
+        row -> chunks = realloc(row -> chunks, sizeof(struct row_chunk) * (row -> u.big.num_chunks + 1));
+        chunk = &row -> chunks[k];
+        memmove(chunk + 1, chunk, sizeof(struct row_chunk) * (row -> u.big.num_chunks - k));
+        row -> u.big.num_chunks++;
+        chunk[1].len = chunk -> len - TTE_ROW_CHUNK;
+        chunk -> len = TTE_ROW_CHUNK;
+        editorRowChunkMeasure(chunk, &row -> chars[start]);
+        editorRowChunkMeasure(chunk + 1, &row -> chars[start + TTE_ROW_CHUNK]);
+    } else {
+        editorRowChunkMeasure(chunk, &row -> chars[start]);
+    }
+    editorRowMeta(row);
+}
+
+// Renders the columns of a long row between `col` and `col + width`
+// into out, returning how many there are.
+ssize_t editorRowRenderSlice(editor_row* row, ssize_t col, ssize_t width, char* out) {
+    ssize_t k = editorRowChunkAtCol(row, col);
+    ssize_t cur_col = row -> chunks[k].rx;
+    ssize_t len = 0;
+    for (ssize_t j = row -> chunks[k].x; j < row -> size && cur_col < col + width; j++) {
+        ssize_t next = row -> chars[j] == '\t' ? (cur_col / TTE_TAB_STOP + 1) * TTE_TAB_STOP : cur_col + 1;
+        for (; cur_col < next && cur_col < col + width; cur_col++) {
+            if (cur_col >= col)
+                out[len++] = row -> chars[j] == '\t' ? ' ' : row -> chars[j];
+        }
+    }
+    return len;
+}
+
+ssize_t editorRowCursorXToRenderX(editor_row* row, ssize_t cursor_x) {
+    // Without tabs, every char is one column.
+    if (row -> render_alias)
+        return cursor_x;
+    ssize_t render_x = 0;
+    ssize_t j = 0;
+    if (row -> chunks) {
+        ssize_t k = editorRowChunkAt(row, cursor_x);
+        j = row -> chunks[k].x;
+        render_x = row -> chunks[k].rx;
+    }
     // For each character, if its a tab we use rx % TTE_TAB_STOP
     // to find out how many columns we are to the right of the last
     // tab stop, and then subtract that from TTE_TAB_STOP - 1 to
@@ -837,7 +2061,7 @@ int editorRowCursorXToRenderX(editor_row* row, int cursor_x) {
     // next tab stop, and then the unconditional rx++ statement gets
     // us right on the next tab stop. Notice how this works even if
     // we are currently on a tab stop.
-    for (j = 0; j < cursor_x; j++) {
+    for (; j < cursor_x; j++) {
         if (row -> chars[j] == '\t')
             render_x += (TTE_TAB_STOP - 1) - (render_x % TTE_TAB_STOP);
         render_x++;
@@ -845,10 +2069,17 @@ int editorRowCursorXToRenderX(editor_row* row, int cursor_x) {
     return render_x;
 }
 
-int editorRowRenderXToCursorX(editor_row* row, int render_x) {
-    int cur_render_x = 0;
-    int cursor_x;
-    for (cursor_x = 0; cursor_x < row -> size; cursor_x++) {
+ssize_t editorRowRenderXToCursorX(editor_row* row, ssize_t render_x) {
+    if (row -> render_alias)
+        return render_x < row -> size ? render_x : row -> size;
+    ssize_t cur_render_x = 0;
+    ssize_t cursor_x = 0;
+    if (row -> chunks) {
+        ssize_t k = editorRowChunkAtCol(row, render_x);
+        cursor_x = row -> chunks[k].x;
+        cur_render_x = row -> chunks[k].rx;
+    }
+    for (; cursor_x < row -> size; cursor_x++) {
         if (row -> chars[cursor_x] == '\t')
             cur_render_x += (TTE_TAB_STOP - 1) - (cur_render_x % TTE_TAB_STOP);
         cur_render_x++;
@@ -859,7 +2090,26 @@ int editorRowRenderXToCursorX(editor_row* row, int render_x) {
     return cursor_x;
 }
 
-void editorUpdateRow(editor_row* row) {
+// Returns -1 if there's no memory for the render or the highlight, the
+// row is then drawn empty or without colors. Its chars are kept.
+int editorUpdateRow(editor_row* row) {
+    // Long rows keep chunks instead of a rendered copy.
+    if (row -> size >= TTE_LONG_ROW) {
+        if (!row -> render_alias)
+            rowFree(row -> render);
+        row -> render_alias = 0;
+        if (!row -> highlight_inline)
+            rowFree(row -> highlight);
+        row -> highlight_inline = 0;
+        row -> render = NULL;
+        row -> highlight = NULL;
+        editorRowChunkAll(row);
+        return editorUpdateSyntax(row);
+    }
+    // u.big is left alone, short rows may be using u.small.
+    free(row -> chunks);
+    row -> chunks = NULL;
+
     // First, we have to loop through the chars of the row
     // and count the tabs in order to know how much memory
     // to allocate for render. The maximum number of characters
@@ -867,21 +2117,35 @@ void editorUpdateRow(editor_row* row) {
     // each tab, so we multiply the number of tabs by 7 and add
     // that to row->size to get the maximum amount of memory we'll
     // need for the rendered row.
-    int tabs = 0;
-    int j;
+    ssize_t tabs = 0;
+    ssize_t j;
     for (j = 0; j < row -> size; j++) {
         if (row -> chars[j] == '\t')
             tabs++;
     }
-    free(row -> render);
-    row -> render = malloc(row -> size + tabs * (TTE_TAB_STOP - 1) + 1);
+    if (!row -> render_alias)
+        rowFree(row -> render);
+    // Most rows have no tabs, they would be rendered as they are. So
+    // instead of making a copy, render points to chars.
+    row -> render_alias = tabs == 0;
+    if (tabs == 0) {
+        row -> render = row -> chars;
+        row -> render_size = row -> size;
+        return editorUpdateSyntax(row);
+    }
+    row -> render = rowAlloc(row -> size + tabs * (TTE_TAB_STOP - 1) + 1);
+    if (row -> render == NULL) {
+        row -> render_size = 0;
+        editorUpdateSyntax(row);
+        return -1;
+    }
 
     // After allocating the memory, we check whether the current character
     // is a tab. If it is, we append one space (because each tab must
     // advance the cursor forward at least one column), and then append
     // spaces until we get to a tab stop, which is a column that is
     // divisible by 8
-    int idx = 0;
+    ssize_t idx = 0;
     for (j = 0; j < row -> size; j++) {
         if (row -> chars[j] == '\t') {
             row -> render[idx++] = ' ';
@@ -893,51 +2157,167 @@ void editorUpdateRow(editor_row* row) {
     row -> render[idx] = '\0';
     row -> render_size = idx;
 
-    editorUpdateSyntax(row);
+    return editorUpdateSyntax(row);
 }
 
-void editorInsertRow(int at, char* s, size_t line_len) {
+// Returns -1 if there's no memory for the row.
+int editorInsertRow(ssize_t at, char* s, size_t line_len) {
     if (at < 0 || at > ec.num_rows)
-        return;
+        return -1;
 
-    ec.row = realloc(ec.row, sizeof(editor_row) * (ec.num_rows + 1));
+    // The new row is made first, s may be the chars of a row that's
+    // about to move.
+    editor_row new_row;
+    if (editorRowInit(&new_row, at, s, line_len) == -1) {
+        editorMemoryFull();
+        return -1;
+    }
+
+    if (ec.num_rows == ec.row_cap) {
+        ssize_t row_cap = ec.row_cap ? ec.row_cap * 2 : 16;
+        // Close to --max-memory, the rows grow by less at a time.
+        if (ec.max_memory && editorMemoryUsed() + (row_cap - ec.row_cap) * (ssize_t) sizeof(editor_row) > ec.max_memory)
+            row_cap = ec.row_cap + ec.row_cap / 8 + 16;
+        editor_row* rows = realloc(ec.row, sizeof(editor_row) * row_cap);
+        if (rows == NULL) {
+            editorFreeRow(&new_row);
+            editorMemoryFull();
+            return -1;
+        }
+        for (ssize_t j = 0; rows != ec.row && j < ec.num_rows; j++)
+            editorRowRelink(&rows[j]);
+        ec.row = rows;
+        ec.row_cap = row_cap;
+    }
     memmove(&ec.row[at + 1], &ec.row[at], sizeof(editor_row) * (ec.num_rows - at));
+    editorMetaInsert(at);
 
-    for (int j = at + 1; j <= ec.num_rows; j++) {
+    for (ssize_t j = at + 1; j <= ec.num_rows; j++) {
         ec.row[j].idx++;
+        editorRowRelink(&ec.row[j]);
     }
 
-    ec.row[at].idx = at;
-
-    ec.row[at].size = line_len;
-    ec.row[at].chars = malloc(line_len + 1); // We want to add terminator char '\0' at the end
-    memcpy(ec.row[at].chars, s, line_len);
-    ec.row[at].chars[line_len] = '\0';
-
-    ec.row[at].render_size = 0;
-    ec.row[at].render = NULL;
-    ec.row[at].highlight = NULL;
-    ec.row[at].hl_open_comment = 0;
-    editorUpdateRow(&ec.row[at]);
+    ec.row[at] = new_row;
+    editorRowRelink(&ec.row[at]);
+    // The row is there even if it can't be drawn.
+    if (editorUpdateRow(&ec.row[at]) == -1)
+        editorMemoryFull();
 
     ec.num_rows++;
     ec.dirty++;
+    return 0;
 }
 
 void editorFreeRow(editor_row* row) {
-    free(row -> render);
-    free(row -> chars);
-    free(row -> highlight);
+    if (row -> cold) {
+        coldRelease(row -> u.cold.block);
+        return;
+    }
+    free(row -> chunks);
+    if (!row -> render_alias)
+        rowFree(row -> render);
+    if (row -> chars_shared)
+        rowRelease(row -> chars, row -> size);
+    else if (!row -> chars_inline)
+        rowFree(row -> chars);
+    if (!row -> highlight_inline)
+        rowFree(row -> highlight);
+}
+
+// Compresses rows [from, to) into one cold block. Only their size and
+// comment state are kept, everything else is given back. Long rows are
+// left alone. Without memory for the block, the rows stay as they are.
+void editorFreezeRows(ssize_t from, ssize_t to) {
+    size_t raw_len = 0;
+    ssize_t rows = 0;
+    for (ssize_t y = from; y < to; y++) {
+        if (!ec.row[y].cold && !ec.row[y].chunks) {
+            raw_len += ec.row[y].size + 1;
+            rows++;
+        }
+    }
+    if (rows == 0)
+        return;
+    char* raw = malloc(raw_len);
+    struct cold_block* block = malloc(sizeof(struct cold_block));
+    char* data = malloc(lzBound(raw_len));
+    if (raw == NULL || block == NULL || data == NULL) {
+        free(raw);
+        free(block);
+        free(data);
+        return;
+    }
+    block -> data = data;
+    block -> raw_len = raw_len;
+    block -> rows = rows;
+    size_t offset = 0;
+    for (ssize_t y = from; y < to; y++) {
+        editor_row* row = &ec.row[y];
+        if (row -> cold || row -> chunks)
+            continue;
+        memcpy(&raw[offset], row -> chars, row -> size + 1);
+        editorFreeRow(row);
+        row -> chars = row -> render = NULL;
+        row -> highlight = NULL;
+        row -> render_size = 0;
+        row -> chars_inline = row -> chars_shared = row -> render_alias = row -> highlight_inline = 0;
+        row -> cold = 1;
+        row -> u.cold.block = block;
+        row -> u.cold.offset = offset;
+        offset += row -> size + 1;
+        editorRowMeta(row);
+    }
+    block -> len = lzCompress(raw, raw_len, block -> data);
+    // If it can't be shrunk, the bigger buffer is kept.
+    if ((data = realloc(block -> data, block -> len)) != NULL)
+        block -> data = data;
+    ec.cold.bytes += block -> len;
+    free(raw);
+}
+
+// Cold rows are decompressed as soon as they are shown or changed.
+// Returns -1 (and the row stays cold) if there's no memory for it.
+int editorRowThaw(editor_row* row) {
+    if (!row -> cold)
+        return 0;
+    struct cold_block* block = row -> u.cold.block;
+    size_t offset = row -> u.cold.offset;
+    ssize_t size = row -> size;
+    const char* text = editorRowText(row);
+    row -> cold = 0;
+    if (editorRowSetChars(row, text, size) == -1) {
+        row -> cold = 1;
+        row -> chars = NULL;
+        row -> size = size;
+        row -> u.cold.block = block;
+        row -> u.cold.offset = offset;
+        return -1;
+    }
+    coldRelease(block);
+    // It's thawed even if it can't be drawn.
+    if (editorUpdateRow(row) == -1)
+        editorMemoryFull();
+    return 0;
+}
+
+// Rows that can't be thawed are drawn empty.
+void editorThawRows(ssize_t from, ssize_t to) {
+    for (ssize_t y = from < 0 ? 0 : from; y < to && y < ec.num_rows; y++) {
+        if (editorRowThaw(&ec.row[y]) == -1 && !ec.memory_full)
+            editorMemoryFull();
+    }
 }
 
-void editorDelRow(int at) {
+void editorDelRow(ssize_t at) {
     if (at < 0 || at >= ec.num_rows)
         return;
     editorFreeRow(&ec.row[at]);
     memmove(&ec.row[at], &ec.row[at + 1], sizeof(editor_row) * (ec.num_rows - at - 1));
+    editorMetaDelete(at);
 
-    for (int j = at; j < ec.num_rows - 1; j++) {
+    for (ssize_t j = at; j < ec.num_rows - 1; j++) {
         ec.row[j].idx--;
+        editorRowRelink(&ec.row[j]);
     }
 
     ec.num_rows--;
@@ -952,29 +2332,34 @@ void editorFlipRow(int dir) {
 
     ec.row[ec.cursor_y].idx += dir;
     ec.row[ec.cursor_y - dir].idx -= dir;
+    editorRowRelink(&ec.row[ec.cursor_y]);
+    editorRowRelink(&ec.row[ec.cursor_y - dir]);
 
-    int first = (dir == 1) ? ec.cursor_y - 1 : ec.cursor_y;
-    editorUpdateSyntax(&ec.row[first]);
-    editorUpdateSyntax(&ec.row[first] + 1);
+    ssize_t first = (dir == 1) ? ec.cursor_y - 1 : ec.cursor_y;
+    int failed = editorUpdateSyntax(&ec.row[first]) == -1;
+    failed |= editorUpdateSyntax(&ec.row[first] + 1) == -1;
     if (ec.num_rows - ec.cursor_y > 2)
-      editorUpdateSyntax(&ec.row[first] + 2);
+      failed |= editorUpdateSyntax(&ec.row[first] + 2) == -1;
+    if (failed)
+      editorMemoryFull();
 
     ec.cursor_y -= dir;
     ec.dirty++;
 }
 
 void editorCopy(bool printStatus) {
-    ec.copied_char_buffer = realloc(ec.copied_char_buffer, strlen(ec.row[ec.cursor_y].chars) + 1);
-    strcpy(ec.copied_char_buffer, ec.row[ec.cursor_y].chars);
+    editor_row* row = &ec.row[ec.cursor_y];
+    ec.copied_char_buffer = realloc(ec.copied_char_buffer, row -> size + 1);
+    memcpy(ec.copied_char_buffer, editorRowText(row), row -> size + 1);
     if(printStatus) editorSetStatusMessage("Content copied");
 }
 
 void editorCut() {
     editorDelRow(ec.cursor_y);
-    if (ec.num_rows - ec.cursor_y > 0)
-        editorUpdateSyntax(&ec.row[ec.cursor_y]);
-    if (ec.num_rows - ec.cursor_y > 1)
-        editorUpdateSyntax(&ec.row[ec.cursor_y + 1]);
+    if (ec.num_rows - ec.cursor_y > 0 && editorUpdateSyntax(&ec.row[ec.cursor_y]) == -1)
+        editorMemoryFull();
+    if (ec.num_rows - ec.cursor_y > 1 && editorUpdateSyntax(&ec.row[ec.cursor_y + 1]) == -1)
+        editorMemoryFull();
     ec.cursor_x = ec.cursor_y == ec.num_rows ? 0 : ec.row[ec.cursor_y].size;
     editorSetStatusMessage("Content cut");
 }
@@ -983,236 +2368,3152 @@ void editorPaste() {
     if (ec.copied_char_buffer == NULL)
       return;
 
-    if (ec.cursor_y == ec.num_rows)
-      editorInsertRow(ec.cursor_y, ec.copied_char_buffer, strlen(ec.copied_char_buffer));
-    else
-      editorRowAppendString(&ec.row[ec.cursor_y], ec.copied_char_buffer, strlen(ec.copied_char_buffer));
+    if (ec.cursor_y == ec.num_rows) {
+      if (editorInsertRow(ec.cursor_y, ec.copied_char_buffer, strlen(ec.copied_char_buffer)) == -1)
+        return;
+    } else if (editorRowAppendString(&ec.row[ec.cursor_y], ec.copied_char_buffer, strlen(ec.copied_char_buffer)) == -1) {
+      return;
+    }
     ec.cursor_x += strlen(ec.copied_char_buffer);
 }
 
-void editorRowInsertChar(editor_row* row, int at, int c) {
+// Returns -1 (and the row is left as it was) if there's no memory for it.
+int editorRowInsertChar(editor_row* row, ssize_t at, int c) {
     if (at < 0 || at > row -> size)
         at = row -> size;
     // We need to allocate 2 bytes because we also have to make room for
     // the null byte.
-    row -> chars = realloc(row -> chars, row -> size + 2);
+    if (editorRowReserve(row, row -> size + 2) == -1) {
+        editorMemoryFull();
+        return -1;
+    }
     // memmove it's like memcpy(), but is safe to use when the source and
     // destination arrays overlap
     memmove(&row -> chars[at + 1], &row -> chars[at], row -> size - at + 1);
     row -> size++;
     row -> chars[at] = c;
-    editorUpdateRow(row);
+    if (row -> chunks)
+        editorRowChunkEdit(row, at, 1);
+    else if (editorUpdateRow(row) == -1)
+        editorMemoryFull();
     ec.dirty++; // This way we can see "how dirty" a file is.
+    return 0;
 }
 
+// Without memory for the new row nothing is changed, the cursor included.
 void editorInsertNewline() {
     // If we're at the beginning of a line, all we have to do is insert
     // a new blank row before the line we're on.
     if (ec.cursor_x == 0) {
-        editorInsertRow(ec.cursor_y, "", 0);
+        if (editorInsertRow(ec.cursor_y, "", 0) == -1)
+            return;
     // Otherwise, we have to split the line we're on into two rows.
     } else {
         editor_row* row = &ec.row[ec.cursor_y];
-        editorInsertRow(ec.cursor_y + 1, &row -> chars[ec.cursor_x], row -> size - ec.cursor_x);
+        if (editorRowUnshare(row) == -1) {
+            editorMemoryFull();
+            return;
+        }
+        if (editorInsertRow(ec.cursor_y + 1, &row -> chars[ec.cursor_x], row -> size - ec.cursor_x) == -1)
+            return;
         row = &ec.row[ec.cursor_y];
         row -> size = ec.cursor_x;
         row -> chars[row -> size] = '\0';
-        editorUpdateRow(row);
+        if (editorUpdateRow(row) == -1)
+            editorMemoryFull();
     }
     ec.cursor_y++;
     ec.cursor_x = 0;
 }
 
-void editorRowAppendString(editor_row* row, char* s, size_t len) {
-    row -> chars = realloc(row -> chars, row -> size + len + 1);
+// Returns -1 (and the row is left as it was) if there's no memory for it.
+int editorRowAppendString(editor_row* row, char* s, size_t len) {
+    if (editorRowReserve(row, row -> size + len + 1) == -1) {
+        editorMemoryFull();
+        return -1;
+    }
     memcpy(&row -> chars[row -> size], s, len);
     row -> size += len;
     row -> chars[row -> size] = '\0';
-    editorUpdateRow(row);
+    if (editorUpdateRow(row) == -1)
+        editorMemoryFull();
+    ec.dirty++;
+    return 0;
+}
+
+// Returns -1 (and the row is left as it was) if there's no memory for it.
+int editorRowDelChar(editor_row* row, ssize_t at) {
+    if (at < 0 || at >= row -> size)
+        return 0;
+    if (editorRowUnshare(row) == -1) {
+        editorMemoryFull();
+        return -1;
+    }
+    // Overwriting the deleted character with the characters that come
+    // after it.
+    memmove(&row -> chars[at], &row -> chars[at + 1], row -> size - at);
+    row -> size--;
+    if (row -> chunks && row -> size >= TTE_LONG_ROW)
+        editorRowChunkEdit(row, at, -1);
+    else if (editorUpdateRow(row) == -1)
+        editorMemoryFull();
     ec.dirty++;
+    return 0;
+}
+
+void editorRowDelString(editor_row* row, ssize_t at, ssize_t len) {
+    if (at < 0 || (at + len - 1) >= row -> size)
+        return;
+    if (editorRowUnshare(row) == -1) {
+        editorMemoryFull();
+        return;
+    }
+    // Overwriting the deleted string with the characters that come
+    // after it.
+    memmove(&row -> chars[at], &row -> chars[at + len], row -> size - (at + len) + 1);
+    row -> size -= len;
+    if (editorUpdateRow(row) == -1)
+        editorMemoryFull();
+    ec.dirty += len;
+}
+
+void editorRowInsertString(editor_row* row, ssize_t at, char* str) {
+    ssize_t len = strlen(str);
+    if (at < 0 || at > row -> size)
+        return;
+    if (editorRowReserve(row, row -> size + len + 2) == -1) {
+        editorMemoryFull();
+        return;
+    }
+    // Move 'after-at' part of string content to the end.
+    memmove(&row -> chars[at + len], &row -> chars[at], row -> size - at);
+    // Copy contents of str into the created space.
+    memcpy(&row -> chars[at], str, strlen(str));
+    row -> size += len;
+    row -> chars[row -> size] = '\0';
+    if (editorUpdateRow(row) == -1)
+        editorMemoryFull();
+    ec.dirty += len;
+}
+
+/*** Editor operations ***/
+
+void editorInsertChar(int c) {
+    // If this is true, the cursor is on the tilde line after the end of
+    // the file, so we need to append a new row to the file before inserting
+    // a character there.
+    if (ec.cursor_y == ec.num_rows && editorInsertRow(ec.num_rows, "", 0) == -1)
+        return;
+    if (editorRowInsertChar(&ec.row[ec.cursor_y], ec.cursor_x, c) == -1)
+        return;
+    ec.cursor_x++; // This way we can see "how dirty" a file is.
+}
+
+void editorDelChar() {
+    // If the cursor is past the end of the file, there's nothing to delete.
+    if (ec.cursor_y == ec.num_rows)
+        return;
+    // Cursor is at the beginning of a file, there's nothing to delete.
+    if (ec.cursor_x == 0 && ec.cursor_y == 0)
+        return;
+
+    editor_row* row = &ec.row[ec.cursor_y];
+    if (ec.cursor_x > 0) {
+        if (editorRowDelChar(row, ec.cursor_x - 1) == -1)
+            return;
+        ec.cursor_x--;
+    // Deleting a line and moving up all the content. The line is only
+    // deleted once it's been appended to the one above.
+    } else {
+        ssize_t x = ec.row[ec.cursor_y - 1].size;
+        // Thawing the row above could reuse the buffer this one is read from.
+        if (editorRowThaw(row) == -1) {
+            editorMemoryFull();
+            return;
+        }
+        if (editorRowAppendString(&ec.row[ec.cursor_y -1], row -> chars, row -> size) == -1)
+            return;
+        ec.cursor_x = x;
+        editorDelRow(ec.cursor_y);
+        ec.cursor_y--;
+    }
+}
+
+/*** Async I/O ***/
+
+#ifdef TTE_IO_URING
+// A minimal io_uring: a submission queue where we put requests and a
+// completion queue where the kernel puts the results, both shared with
+// the kernel through mmap().
+struct io_ring {
+    int fd;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned to_submit;
+};
+
+void ioRingExit(struct io_ring* ring) {
+    if (ring -> sqes != MAP_FAILED)
+        munmap(ring -> sqes, ring -> sqes_size);
+    if (ring -> cq_ring != MAP_FAILED)
+        munmap(ring -> cq_ring, ring -> cq_ring_size);
+    if (ring -> sq_ring != MAP_FAILED)
+        munmap(ring -> sq_ring, ring -> sq_ring_size);
+    close(ring -> fd);
+}
+
+// Returns -1 if io_uring is not available (old kernel, seccomp...).
+int ioRingInit(struct io_ring* ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring -> fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring -> fd < 0)
+        return -1;
+
+    ring -> sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring -> cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring -> sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring -> sq_ring = mmap(NULL, ring -> sq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring -> fd, IORING_OFF_SQ_RING);
+    ring -> cq_ring = mmap(NULL, ring -> cq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring -> fd, IORING_OFF_CQ_RING);
+    ring -> sqes = mmap(NULL, ring -> sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring -> fd, IORING_OFF_SQES);
+    if (ring -> sq_ring == MAP_FAILED || ring -> cq_ring == MAP_FAILED || ring -> sqes == MAP_FAILED) {
+        ioRingExit(ring);
+        return -1;
+    }
+
+    char* sq = ring -> sq_ring;
+    char* cq = ring -> cq_ring;
+    ring -> sq_tail = (unsigned*) (sq + params.sq_off.tail);
+    ring -> sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+    ring -> sq_array = (unsigned*) (sq + params.sq_off.array);
+    ring -> cq_head = (unsigned*) (cq + params.cq_off.head);
+    ring -> cq_tail = (unsigned*) (cq + params.cq_off.tail);
+    ring -> cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+    ring -> cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+    ring -> to_submit = 0;
+    return 0;
+}
+
+// Queues a read or write. Nothing happens until ioRingEnter().
+void ioRingPrep(struct io_ring* ring, int op, int fd, char* buf, size_t len, off_t offset, uint64_t data) {
+    unsigned tail = *ring -> sq_tail;
+    unsigned idx = tail & *ring -> sq_mask;
+    struct io_uring_sqe* sqe = &ring -> sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe -> opcode = op;
+    sqe -> fd = fd;
+    sqe -> addr = (uint64_t) (uintptr_t) buf;
+    sqe -> len = len;
+    sqe -> off = offset;
+    sqe -> user_data = data;
+    ring -> sq_array[idx] = idx;
+    // The kernel must see the entry before it sees the new tail.
+    __atomic_store_n(ring -> sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring -> to_submit++;
+}
+
+// Submits the queued requests and waits until at least one is done.
+int ioRingEnter(struct io_ring* ring) {
+    int ret;
+    do {
+        ret = syscall(__NR_io_uring_enter, ring -> fd, ring -> to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    } while (ret == -1 && errno == EINTR);
+    if (ret > 0)
+        ring -> to_submit -= ret;
+    return ret;
+}
+
+// Takes one result out of the completion queue, returns false if empty.
+int ioRingReap(struct io_ring* ring, uint64_t* data, int* res) {
+    unsigned head = *ring -> cq_head;
+    if (head == __atomic_load_n(ring -> cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+    struct io_uring_cqe* cqe = &ring -> cqes[head & *ring -> cq_mask];
+    *data = cqe -> user_data;
+    *res = cqe -> res;
+    __atomic_store_n(ring -> cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Takes back the requests queued but not submitted yet (after a failed
+// ioRingEnter()), the kernel never saw them. Returns how many there were
+// and puts their data in data.
+unsigned ioRingUnprep(struct io_ring* ring, uint64_t* data) {
+    unsigned tail = *ring -> sq_tail;
+    unsigned count = ring -> to_submit;
+    for (unsigned i = 0; i < count; i++)
+        data[i] = ring -> sqes[(tail - count + i) & *ring -> sq_mask].user_data;
+    __atomic_store_n(ring -> sq_tail, tail - count, __ATOMIC_RELEASE);
+    ring -> to_submit = 0;
+    return count;
+}
+#endif
+
+// Reads a file sequentially, chunk after chunk. With io_uring, the next
+// TTE_IO_DEPTH chunks are already being read while the current one is
+// split into rows, otherwise it's a plain pread() loop.
+struct file_reader {
+    int fd;
+    off_t offset; // Where the next chunk handed out starts.
+    char* buf[TTE_IO_DEPTH];
+#ifdef TTE_IO_URING
+    int use_ring;
+    struct io_ring ring;
+    int in_flight[TTE_IO_DEPTH];
+    int done[TTE_IO_DEPTH];
+    int result[TTE_IO_DEPTH];
+    off_t chunk_offset[TTE_IO_DEPTH];
+    int head; // Buffer holding the next chunk to hand out.
+    int given; // Buffer handed out by the last call, -1 if none.
+    off_t next_offset; // Offset of the next read to submit.
+#endif
+};
+
+#ifdef TTE_IO_URING
+void readerSubmit(struct file_reader* reader, int k) {
+    reader -> chunk_offset[k] = reader -> next_offset;
+    reader -> next_offset += TTE_READ_CHUNK;
+    reader -> in_flight[k] = 1;
+    reader -> done[k] = 0;
+    ioRingPrep(&reader -> ring, IORING_OP_READ, reader -> fd, reader -> buf[k],
+        TTE_READ_CHUNK, reader -> chunk_offset[k], k);
+}
+
+// Waits for the reads still in flight (the kernel writes into our
+// buffers until they are done) and goes back to plain reads.
+void readerDrain(struct file_reader* reader) {
+    for (int k = 0; k < TTE_IO_DEPTH; k++) {
+        while (reader -> in_flight[k] && !reader -> done[k]) {
+            uint64_t done;
+            int res;
+            if (ioRingEnter(&reader -> ring) < 0)
+                break;
+            while (ioRingReap(&reader -> ring, &done, &res))
+                reader -> done[done] = 1;
+        }
+        reader -> in_flight[k] = 0;
+    }
+    ioRingExit(&reader -> ring);
+    reader -> use_ring = 0;
+}
+#endif
+
+void readerOpen(struct file_reader* reader, int fd, off_t offset) {
+    reader -> fd = fd;
+    reader -> offset = offset;
+    memset(reader -> buf, 0, sizeof(reader -> buf));
+    reader -> buf[0] = malloc(TTE_READ_CHUNK);
+#ifdef TTE_IO_URING
+    // Small reads (like the ones in follow mode) are not worth it.
+    struct stat st;
+    reader -> use_ring = fstat(fd, &st) == 0 && st.st_size - offset >= 2 * TTE_READ_CHUNK &&
+        ioRingInit(&reader -> ring, TTE_IO_DEPTH) == 0;
+    if (!reader -> use_ring)
+        return;
+    reader -> head = 0;
+    reader -> given = -1;
+    reader -> next_offset = offset;
+    for (int k = 0; k < TTE_IO_DEPTH; k++) {
+        if (k > 0)
+            reader -> buf[k] = malloc(TTE_READ_CHUNK);
+        readerSubmit(reader, k);
+    }
+#endif
+}
+
+// Points data to the next chunk and returns its size, 0 at the end of
+// the file and -1 on errors. The chunk is valid until the next call.
+ssize_t readerNext(struct file_reader* reader, char** data) {
+#ifdef TTE_IO_URING
+    if (reader -> use_ring) {
+        // The previous chunk was used, so its buffer can read ahead again.
+        if (reader -> given != -1)
+            readerSubmit(reader, reader -> given);
+        reader -> given = -1;
+
+        int k = reader -> head;
+        while (!reader -> done[k]) {
+            uint64_t done;
+            int res;
+            if (ioRingEnter(&reader -> ring) < 0) {
+                readerDrain(reader);
+                return readerNext(reader, data);
+            }
+            while (ioRingReap(&reader -> ring, &done, &res)) {
+                reader -> done[done] = 1;
+                reader -> result[done] = res;
+            }
+        }
+        reader -> in_flight[k] = 0;
+
+        ssize_t nread = reader -> result[k];
+        // The kernel can't do it (too old for IORING_OP_READ...), we read
+        // that chunk by ourselves.
+        if (nread < 0) {
+            do {
+                nread = pread(reader -> fd, reader -> buf[k], TTE_READ_CHUNK, reader -> chunk_offset[k]);
+            } while (nread == -1 && errno == EINTR);
+        }
+        if (nread > 0)
+            reader -> offset = reader -> chunk_offset[k] + nread;
+        reader -> given = k;
+        reader -> head = (k + 1) % TTE_IO_DEPTH;
+        // A short read is usually the end of the file. Either way the reads
+        // after it started at the wrong offset, so we go on without them.
+        if (nread < TTE_READ_CHUNK) {
+            reader -> given = -1;
+            readerDrain(reader);
+        }
+        *data = reader -> buf[k];
+        return nread;
+    }
+#endif
+    ssize_t nread;
+    do {
+        nread = pread(reader -> fd, reader -> buf[0], TTE_READ_CHUNK, reader -> offset);
+    } while (nread == -1 && errno == EINTR);
+    if (nread > 0)
+        reader -> offset += nread;
+    *data = reader -> buf[0];
+    return nread;
+}
+
+void readerClose(struct file_reader* reader) {
+#ifdef TTE_IO_URING
+    if (reader -> use_ring)
+        readerDrain(reader);
+#endif
+    for (int k = 0; k < TTE_IO_DEPTH; k++)
+        free(reader -> buf[k]);
+}
+
+// Writes the whole buffer at the given offset. write() may write less
+// than asked for (Linux never writes more than about 2 GiB at once), so
+// we keep going until everything is written. Big buffers are written
+// with io_uring, TTE_IO_DEPTH chunks at once. Returns -1 on errors.
+int writeAll(int fd, const char* buf, size_t len, off_t offset) {
+    size_t written = 0;
+#ifdef TTE_IO_URING
+    struct io_ring ring;
+    if (len >= 2 * TTE_WRITE_CHUNK && ioRingInit(&ring, TTE_IO_DEPTH) == 0) {
+        size_t chunk_offset[TTE_IO_DEPTH];
+        size_t chunk_len[TTE_IO_DEPTH];
+        int busy[TTE_IO_DEPTH] = {0};
+        // Chunks left to pwrite() once the ring is given up.
+        int redo[TTE_IO_DEPTH] = {0};
+        int in_flight = 0;
+        int failed = 0;
+        int broken = 0;
+        size_t next = 0;
+        while (in_flight || (next < len && !failed && !broken)) {
+            for (int k = 0; k < TTE_IO_DEPTH && next < len && !failed && !broken; k++) {
+                if (busy[k])
+                    continue;
+                chunk_offset[k] = next;
+                chunk_len[k] = len - next < TTE_WRITE_CHUNK ? len - next : TTE_WRITE_CHUNK;
+                ioRingPrep(&ring, IORING_OP_WRITE, fd, (char*) &buf[next], chunk_len[k], offset + next, k);
+                busy[k] = 1;
+                in_flight++;
+                next += chunk_len[k];
+            }
+            if (ioRingEnter(&ring) < 0) {
+                // The writes already submitted still read from buf, so
+                // we wait for all of them before going on with pwrite().
+                // Only a dead ring (no way to wait) gives up on them.
+                if (broken && errno != EAGAIN && errno != EBUSY) {
+                    failed = 1;
+                    break;
+                }
+                broken = 1;
+                uint64_t unsent[TTE_IO_DEPTH];
+                unsigned count = ioRingUnprep(&ring, unsent);
+                for (unsigned i = 0; i < count; i++) {
+                    busy[unsent[i]] = 0;
+                    redo[unsent[i]] = 1;
+                    in_flight--;
+                }
+            }
+            uint64_t k;
+            int res;
+            while (ioRingReap(&ring, &k, &res)) {
+                if (res > 0 && (size_t) res < chunk_len[k]) {
+                    // Short write, the rest goes again.
+                    chunk_offset[k] += res;
+                    chunk_len[k] -= res;
+                    if (!broken) {
+                        ioRingPrep(&ring, IORING_OP_WRITE, fd, (char*) &buf[chunk_offset[k]],
+                            chunk_len[k], offset + chunk_offset[k], k);
+                        continue;
+                    }
+                    redo[k] = 1;
+                    res = chunk_len[k];
+                }
+                // The kernel can't do it (too old for IORING_OP_WRITE...),
+                // so we write that chunk by ourselves.
+                if (res < 0 && res != -EIO && res != -ENOSPC && res != -EDQUOT)
+                    res = writeAll(fd, &buf[chunk_offset[k]], chunk_len[k], offset + chunk_offset[k]) == 0;
+                if (res <= 0)
+                    failed = 1;
+                busy[k] = 0;
+                in_flight--;
+            }
+        }
+        ioRingExit(&ring);
+        if (failed)
+            return -1;
+        for (int k = 0; k < TTE_IO_DEPTH; k++) {
+            if (redo[k] && writeAll(fd, &buf[chunk_offset[k]], chunk_len[k], offset + chunk_offset[k]) == -1)
+                return -1;
+        }
+        // What was never queued is written below.
+        written = next;
+    }
+#endif
+    while (written < len) {
+        ssize_t nwritten = pwrite(fd, &buf[written], len - written, offset + written);
+        if (nwritten == -1 && errno == EINTR)
+            continue;
+        if (nwritten <= 0)
+            return -1;
+        written += nwritten;
+    }
+    return 0;
+}
+
+/*** File I/O ***/
+
+char* editorRowsToString(size_t* buf_len) {
+    if (editorMetaUpdate() == -1)
+        return NULL;
+    // Adding up the lengths of each row of text, adding 1
+    // to each one for the newline character we'll add to
+    // the end of each line.
+    size_t total_len = ec.num_rows;
+    ssize_t j;
+    for (j = 0; j < ec.num_rows; j++)
+        total_len += ec.meta.size[j];
+    *buf_len = total_len;
+
+    char* buf = malloc(total_len);
+    if (buf == NULL)
+        return NULL;
+    char* p = buf;
+    // Copying the contents of each row to the end of the
+    // buffer, appending a newline character after each
+    // row.
+    for (j = 0; j < ec.num_rows; j++) {
+        memcpy(p, editorRowText(&ec.row[j]), ec.row[j].size);
+        p += ec.row[j].size;
+        *p = '\n';
+        p++;
+    }
+
+    return buf;
+}
+
+static int fileExists(const char* file_name) {
+    struct stat s = {0};
+    return stat(file_name, &s) == 0;
+}
+
+// Tells the kernel how we are going to use a range of the file (len 0
+// means up to the end of it). It's only a hint, so errors are ignored.
+void fileAdvise(int fd, off_t offset, off_t len, int advice) {
+#ifdef POSIX_FADV_NORMAL
+    if (offset < 0) {
+        len = len > -offset ? len + offset : 0;
+        offset = 0;
+        if (len == 0)
+            return;
+    }
+    posix_fadvise(fd, offset, len, advice);
+#else
+    (void) fd; (void) offset; (void) len; (void) advice;
+#endif
+}
+
+// Splits the file into rows as it's read. Big files are loaded a slice
+// at a time between keypresses, so the state is kept here meanwhile.
+struct editor_loader {
+    int fd;
+    off_t offset; // Where the next chunk starts.
+    off_t end; // Where loading stops, -1 for the end of the file.
+    off_t size; // Where the file ended when loading started, for the progress.
+    struct file_reader reader;
+    char* carry; // Unfinished line at the end of the last chunk.
+    size_t carry_len;
+    // Rows before the ones in ec.row (+G), kept aside until all of them
+    // are loaded.
+    editor_row* rows;
+    ssize_t num_rows;
+    ssize_t rows_cap;
+};
+
+// Starts loading fd from ec.file_offset, appending every line as a new
+// row. If the last line has no newline, it's loaded anyway but remembered
+// as "open" so the bytes appended later on (follow mode) continue it
+// instead of creating a new row.
+//
+// With `end` other than -1, the lines between offset 0 and `end` (which
+// must start a line) are loaded aside instead, and put before the rows
+// already in ec.row when the loader is done.
+editor_loader* loaderOpen(int fd, off_t end) {
+    editor_loader* ld = malloc(sizeof(editor_loader));
+    ld -> fd = fd;
+    ld -> offset = end == -1 ? ec.file_offset : 0;
+    ld -> end = end;
+    ld -> carry = NULL;
+    ld -> carry_len = 0;
+    ld -> rows = NULL;
+    ld -> num_rows = 0;
+    ld -> rows_cap = 0;
+    if (end == -1 && ec.row_open && ec.num_rows > 0) {
+        editor_row* last = &ec.row[ec.num_rows - 1];
+        ld -> carry = malloc(last -> size);
+        memcpy(ld -> carry, editorRowText(last), last -> size);
+        ld -> carry_len = last -> size;
+        editorDelRow(ec.num_rows - 1);
+    }
+    ec.row_open = 0;
+
+    struct stat st;
+    ld -> size = end != -1 ? end : fstat(fd, &st) == 0 ? st.st_size : 0;
+    // Loading reads the file once from start to end.
+    fileAdvise(fd, ld -> offset, end == -1 ? 0 : end, POSIX_FADV_SEQUENTIAL);
+    readerOpen(&ld -> reader, fd, ld -> offset);
+    return ld;
+}
+
+void loaderSwapRows(editor_loader* ld) {
+    editorMetaInvalidate(0);
+    editor_row* rows = ec.row;
+    ssize_t num_rows = ec.num_rows;
+    ssize_t row_cap = ec.row_cap;
+    ec.row = ld -> rows;
+    ec.num_rows = ld -> num_rows;
+    ec.row_cap = ld -> rows_cap;
+    ld -> rows = rows;
+    ld -> num_rows = num_rows;
+    ld -> rows_cap = row_cap;
+}
+
+long elapsedMs(struct timespec* since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since -> tv_sec) * 1000 + (now.tv_nsec - since -> tv_nsec) / 1000000;
+}
+
+// Loads chunks until there are `rows` rows, `ms` milliseconds have gone
+// by (-1 for no limit) or the file ends. Returns true at the end.
+int loaderRun(editor_loader* ld, ssize_t rows, long ms) {
+    // Loading content is not an edit.
+    ssize_t dirty = ec.dirty;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (ld -> end != -1)
+        loaderSwapRows(ld);
+
+    char* buf;
+    ssize_t nread = 1;
+    while (ec.num_rows < rows && (ms == -1 || elapsedMs(&start) < ms) && !ec.memory_full &&
+        (ld -> end == -1 || ld -> offset < ld -> end) &&
+        (nread = readerNext(&ld -> reader, &buf)) > 0) {
+        if (ld -> end != -1 && ld -> offset + nread > ld -> end)
+            nread = ld -> end - ld -> offset;
+        ld -> offset += nread;
+        if (ld -> end == -1)
+            ec.file_offset = ld -> offset;
+
+        char* p = buf;
+        char* end = buf + nread;
+        char* new_line;
+        // We already know each row represents one line of text, there's no need
+        // to keep newline characters.
+        while ((new_line = memchr(p, '\n', end - p)) != NULL) {
+            if (ld -> carry_len) {
+                ld -> carry = realloc(ld -> carry, ld -> carry_len + (new_line - p));
+                memcpy(&ld -> carry[ld -> carry_len], p, new_line - p);
+                editorInsertRow(ec.num_rows, ld -> carry, ld -> carry_len + (new_line - p));
+                ld -> carry_len = 0;
+            } else {
+                editorInsertRow(ec.num_rows, p, new_line - p);
+            }
+            p = new_line + 1;
+        }
+        // Keeping the unfinished line for the next chunk.
+        if (p < end) {
+            ld -> carry = realloc(ld -> carry, ld -> carry_len + (end - p));
+            memcpy(&ld -> carry[ld -> carry_len], p, end - p);
+            ld -> carry_len += end - p;
+        }
+    }
+    if (ld -> end != -1)
+        loaderSwapRows(ld);
+    ec.dirty = dirty;
+    return nread <= 0 || (ld -> end != -1 && ld -> offset >= ld -> end);
+}
+
+void loaderClose(editor_loader* ld) {
+    if (ld -> num_rows) {
+        // The rows loaded aside go before the others. Everything pointing
+        // to a row moves down by as many.
+        ssize_t old_num_rows = ec.num_rows;
+        ssize_t* old_to_new = malloc(sizeof(ssize_t) * (old_num_rows + 1));
+        for (ssize_t y = 0; y <= old_num_rows; y++)
+            old_to_new[y] = y + ld -> num_rows;
+        ld -> rows = realloc(ld -> rows, sizeof(editor_row) * (ld -> num_rows + old_num_rows));
+        memcpy(&ld -> rows[ld -> num_rows], ec.row, sizeof(editor_row) * old_num_rows);
+        free(ec.row);
+        ec.row = ld -> rows;
+        ec.num_rows = ec.row_cap = ld -> num_rows + old_num_rows;
+        editorMetaInvalidate(0);
+        for (ssize_t y = 0; y < ec.num_rows; y++) {
+            ec.row[y].idx = y;
+            editorRowRelink(&ec.row[y]);
+        }
+        ec.cursor_y += ld -> num_rows;
+        ec.row_offset += ld -> num_rows;
+        remapActions(old_to_new, old_num_rows);
+        free(old_to_new);
+        // The first of the old rows may be inside a multi-line comment.
+        if (old_num_rows && editorUpdateSyntax(&ec.row[ld -> num_rows]) == -1)
+            editorMemoryFull();
+    }
+    if (ld -> end != -1)
+        ec.row_base = 0;
+    if (ld -> carry_len) {
+        ssize_t dirty = ec.dirty;
+        editorInsertRow(ec.num_rows, ld -> carry, ld -> carry_len);
+        ec.row_open = 1;
+        ec.dirty = dirty;
+    }
+    free(ld -> carry);
+    readerClose(&ld -> reader);
+    free(ld);
+}
+
+// Reads fd from ec.file_offset until EOF.
+void editorLoadFrom(int fd) {
+    editor_loader* ld = loaderOpen(fd, -1);
+    loaderRun(ld, SSIZE_MAX, -1);
+    loaderClose(ld);
+}
+
+void editorLoadDone() {
+    close(ec.loader -> fd);
+    loaderClose(ec.loader);
+    ec.loader = NULL;
+}
+
+// Loads the next slice of the file, called while waiting for keys.
+void editorLoadSlice() {
+    if (ec.loader && loaderRun(ec.loader, SSIZE_MAX, TTE_LOAD_SLICE_MS))
+        editorLoadDone();
+}
+
+// Waits until there are `rows` rows (or the whole file is loaded). Going
+// past what's loaded so far only waits for what's needed.
+void editorLoadUntil(ssize_t rows) {
+    if (!ec.loader || ec.num_rows >= rows)
+        return;
+    // With +G the rows already go up to the end of the file. What's
+    // missing are the lines before them, and those come all at once.
+    if (ec.loader -> end != -1 && rows != SSIZE_MAX)
+        return;
+    if (loaderRun(ec.loader, rows, -1))
+        editorLoadDone();
+}
+
+// Scans the file backwards from `size` and returns where the last
+// `lines` lines start (0 if there are not so many).
+off_t fileTailStart(int fd, off_t size, ssize_t lines) {
+    char* buf = malloc(TTE_READ_CHUNK);
+    off_t start = -1;
+    off_t end = size;
+    while (start == -1 && end > 0) {
+        off_t from = end > TTE_READ_CHUNK ? end - TTE_READ_CHUNK : 0;
+        ssize_t nread = pread(fd, buf, end - from, from);
+        if (nread == -1 && errno == EINTR)
+            continue;
+        if (nread != end - from)
+            break;
+        // A newline right at the end finishes the last line, it doesn't
+        // start another one.
+        ssize_t len = end == size && nread > 0 && buf[nread - 1] == '\n' ? nread - 1 : nread;
+        char* new_line;
+        while ((new_line = memrchr(buf, '\n', len)) != NULL) {
+            len = new_line - buf;
+            if (--lines == 0) {
+                start = from + len + 1;
+                break;
+            }
+        }
+        end = from;
+    }
+    free(buf);
+    return start == -1 ? 0 : start;
+}
+
+void editorOpen(char* file_name) {
+    free(ec.file_name);
+    ec.file_name = strdup(file_name);
+
+    editorSelectSyntaxHighlight();
+
+    // If the file dosen't exist, create it, otherwise just open it
+    int flags = fileExists(file_name) ? O_RDWR : O_RDWR | O_CREAT;
+
+    int fd = open(file_name, flags, 0644);
+    if (fd == -1)
+        die("Failed to open the file");
+
+    // Only the first screen is loaded now, so it's shown right away.
+    // The rest is loaded while waiting for keys (see editorReadKey()).
+    ec.file_offset = 0;
+    fstat(fd, &ec.file_stat);
+    // A big file we have opened before: we know how many lines it has and
+    // where the cursor was.
+    struct cache_header cache;
+    off_t* cache_index;
+    signed char* cache_hl_state;
+    int cached = editorCacheLoad(fd, &cache, &cache_index, &cache_hl_state) == 0;
+    if (cached) {
+        free(cache_index);
+        free(cache_hl_state);
+    }
+    if (ec.open_at_end) {
+        // The last screen is found scanning back from the end, and the
+        // lines before it are loaded later on. Until then we don't know
+        // which line numbers the rows have.
+        off_t tail = fileTailStart(fd, ec.file_stat.st_size, ec.screen_rows);
+        ec.file_offset = tail;
+        editorLoadFrom(fd);
+        ec.cursor_y = ec.num_rows > 0 ? ec.num_rows - 1 : 0;
+        if (tail > 0) {
+            ec.row_base = cached && cache.total_lines != -1 ? cache.total_lines - ec.num_rows : -1;
+            ec.loader = loaderOpen(fd, tail);
+        } else {
+            close(fd);
+        }
+    } else {
+        ec.loader = loaderOpen(fd, -1);
+        editorLoadUntil(ec.screen_rows + 1);
+        // The rows up to the cursor are loaded when drawing the screen.
+        if (cached && cache.cursor_line >= 0 && cache.top_line >= 0 && cache.cursor_line <= cache.total_lines) {
+            ec.cursor_y = cache.cursor_line;
+            ec.cursor_x = cache.cursor_x;
+            ec.row_offset = cache.top_line;
+        }
+    }
+    ec.dirty = 0;
+
+    editorWatchStart();
+}
+
+void editorSave() {
+    if (ec.file_name == NULL) {
+        ec.file_name = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+        if (ec.file_name == NULL) {
+            editorSetStatusMessage("Save aborted");
+            return;
+        }
+        editorSelectSyntaxHighlight();
+    }
+
+    // The whole file has to be there before writing it back.
+    editorLoadUntil(SSIZE_MAX);
+    if (ec.loader) {
+        editorSetStatusMessage("Can't save, the file doesn't fit in --max-memory");
+        return;
+    }
+
+    size_t len;
+    char* buf = editorRowsToString(&len);
+    if (buf == NULL) {
+        editorSetStatusMessage("Can't save, out of memory");
+        return;
+    }
+
+    // We want to create if it doesn't already exist (O_CREAT flag), giving
+    // 0644 permissions (the standard ones). O_RDWR stands for reading and
+    // writing.
+    int fd = open(ec.file_name, O_RDWR | O_CREAT, 0644);
+    if (fd != -1) {
+        // ftruncate sets the file's size to the specified length.
+        if (ftruncate(fd, len) != -1) {
+            // Writing the file.
+            if (writeAll(fd, buf, len, 0) == 0) {
+                ec.dirty = 0;
+                // The file now holds exactly our rows.
+                ec.file_offset = len;
+                ec.row_open = 0;
+                fstat(fd, &ec.file_stat);
+                close(fd);
+                free(buf);
+                if (ec.watch_fd == -1)
+                    editorWatchStart();
+                editorSetStatusMessage("%zu bytes written to disk", len);
+                return;
+            }
+        }
+        close(fd);
+    }
+
+    free(buf);
+    editorSetStatusMessage("Cant's save file. Error occurred: %s", strerror(errno));
+}
+
+/*** File watch section ***/
+
+void editorWatchStart() {
+    if (ec.watch_fd != -1)
+        close(ec.watch_fd);
+    ec.watch_fd = -1;
+#ifdef __linux__
+    // inotify lets the kernel tell us when the file changes, so we don't
+    // have to stat() it all the time. It's non blocking because we only
+    // peek at it while waiting for keypresses.
+    ec.watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (ec.watch_fd == -1)
+        return;
+    if (inotify_add_watch(ec.watch_fd, ec.file_name,
+        IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF) == -1) {
+        close(ec.watch_fd);
+        ec.watch_fd = -1;
+    }
+#endif
+}
+
+// Returns true if the file may have changed since the last call. Without
+// inotify we can't know, so the caller has to check it by itself.
+int editorWatchChanged() {
+    if (ec.watch_fd == -1)
+        return 1;
+#ifdef __linux__
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+    int replaced = 0;
+    ssize_t len;
+    while ((len = read(ec.watch_fd, buf, sizeof(buf))) > 0) {
+        changed = 1;
+        char* p = buf;
+        while (p < buf + len) {
+            struct inotify_event* event = (struct inotify_event*) p;
+            // The file was renamed or removed (log rotation, editors saving
+            // through a temporary file...). From now on we want to watch
+            // whatever has its name.
+            if (event -> mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED))
+                replaced = 1;
+            p += sizeof(struct inotify_event) + event -> len;
+        }
+    }
+    if (replaced)
+        editorWatchStart();
+    return changed;
+#else
+    return 1;
+#endif
+}
+
+int fileStatChanged(struct stat* a, struct stat* b) {
+    if (a -> st_ino != b -> st_ino || a -> st_size != b -> st_size ||
+        a -> st_mtime != b -> st_mtime)
+        return 1;
+#ifdef __linux__
+    // Two writes within the same second only differ in the nanoseconds.
+    return a -> st_mtim.tv_nsec != b -> st_mtim.tv_nsec;
+#else
+    return 0;
+#endif
+}
+
+// Follow mode (-f): it works like "tail -f", but we only read the bytes
+// appended since the last time, so rows already loaded are never touched.
+void editorFollow(struct stat* st) {
+    int fd = open(ec.file_name, O_RDONLY);
+    if (fd == -1)
+        return;
+
+    // If the cursor is at the end of the file, we keep it there, so the new
+    // lines scroll into view.
+    ssize_t old_num_rows = ec.num_rows;
+    int at_end = ec.cursor_y >= ec.num_rows - 1;
+    editorLoadFrom(fd);
+    close(fd);
+    ec.file_stat = *st;
+    if (at_end && ec.num_rows != old_num_rows) {
+        ec.cursor_y += ec.num_rows - old_num_rows;
+        ec.cursor_x = 0;
+    }
+}
+
+// FNV-1a, good enough to tell lines apart.
+uint64_t editorHashLine(const char* s, ssize_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (ssize_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) s[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+int editorRowEquals(editor_row* row, const char* s, ssize_t len) {
+    return row -> size == len && memcmp(editorRowText(row), s, len) == 0;
+}
+
+struct diff_slot {
+    uint64_t hash;
+    int used;
+    ssize_t old_count, old_pos;
+    ssize_t new_count, new_pos;
+};
+
+struct diff_slot* diffSlot(struct diff_slot* table, size_t mask, uint64_t hash) {
+    size_t i = hash & mask;
+    while (table[i].used && table[i].hash != hash)
+        i = (i + 1) & mask;
+    table[i].used = 1;
+    table[i].hash = hash;
+    return &table[i];
+}
+
+// Matches rows [old_from, old_to) against lines [new_from, new_to) the
+// "patience diff" way: lines appearing exactly once on both sides are
+// paired, and the longest sequence of pairs that keeps the same order on
+// both sides is kept. Matches are stored in old_to_new and new_to_old.
+void editorDiffMiddle(char** lines, ssize_t* lens, ssize_t old_from, ssize_t old_to,
+    ssize_t new_from, ssize_t new_to, ssize_t* old_to_new, ssize_t* new_to_old) {
+    ssize_t old_len = old_to - old_from;
+    ssize_t new_len = new_to - new_from;
+    if (old_len <= 0 || new_len <= 0)
+        return;
+
+    size_t table_size = 1;
+    while (table_size < 2 * (size_t) (old_len + new_len))
+        table_size <<= 1;
+    struct diff_slot* table = calloc(table_size, sizeof(struct diff_slot));
+    uint64_t* new_hash = malloc(sizeof(uint64_t) * new_len);
+    ssize_t* anchor_old = malloc(sizeof(ssize_t) * new_len);
+    ssize_t* anchor_new = malloc(sizeof(ssize_t) * new_len);
+    ssize_t* prev = malloc(sizeof(ssize_t) * new_len);
+    ssize_t* tails = malloc(sizeof(ssize_t) * new_len);
+    // Without memory for it nothing in the middle is paired, it's all
+    // reloaded.
+    if (table == NULL || new_hash == NULL || anchor_old == NULL || anchor_new == NULL || prev == NULL || tails == NULL) {
+        free(tails);
+        free(prev);
+        free(anchor_new);
+        free(anchor_old);
+        free(new_hash);
+        free(table);
+        return;
+    }
+
+    for (ssize_t i = old_from; i < old_to; i++) {
+        struct diff_slot* slot = diffSlot(table, table_size - 1,
+            editorHashLine(editorRowText(&ec.row[i]), ec.row[i].size));
+        slot -> old_count++;
+        slot -> old_pos = i;
+    }
+    for (ssize_t j = new_from; j < new_to; j++) {
+        new_hash[j - new_from] = editorHashLine(lines[j], lens[j]);
+        struct diff_slot* slot = diffSlot(table, table_size - 1, new_hash[j - new_from]);
+        slot -> new_count++;
+        slot -> new_pos = j;
+    }
+
+    // Unique pairs, in the order of the new lines. Then the longest
+    // increasing subsequence of their old positions: tails[k] is the
+    // anchor ending the best sequence of length k + 1.
+    ssize_t anchors = 0;
+    ssize_t best = 0;
+    for (ssize_t j = new_from; j < new_to; j++) {
+        struct diff_slot* slot = diffSlot(table, table_size - 1, new_hash[j - new_from]);
+        if (slot -> old_count != 1 || slot -> new_count != 1 ||
+            !editorRowEquals(&ec.row[slot -> old_pos], lines[j], lens[j]))
+            continue;
+        anchor_old[anchors] = slot -> old_pos;
+        anchor_new[anchors] = j;
+
+        ssize_t lo = 0, hi = best;
+        while (lo < hi) {
+            ssize_t mid = (lo + hi) / 2;
+            if (anchor_old[tails[mid]] < slot -> old_pos)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        prev[anchors] = lo > 0 ? tails[lo - 1] : -1;
+        tails[lo] = anchors;
+        if (lo == best)
+            best++;
+        anchors++;
+    }
+    for (ssize_t k = best > 0 ? tails[best - 1] : -1; k != -1; k = prev[k]) {
+        old_to_new[anchor_old[k]] = anchor_new[k];
+        new_to_old[anchor_new[k]] = anchor_old[k];
+    }
+
+    free(tails);
+    free(prev);
+    free(anchor_new);
+    free(anchor_old);
+    free(new_hash);
+    free(table);
+}
+
+// Maps an old row index to where it (or the closest row above it) is now.
+ssize_t editorMapRow(ssize_t* old_to_new, ssize_t old_num_rows, ssize_t y) {
+    if (y >= old_num_rows)
+        return ec.num_rows;
+    for (ssize_t k = y; k >= 0; k--) {
+        if (old_to_new[k] != -1)
+            return old_to_new[k] + (k != y);
+    }
+    return 0;
+}
+
+// The file is left as it is on disk, like when the rows are changed.
+void editorReloadFailed(struct stat* st) {
+    ec.file_stat = *st;
+    editorSetStatusMessage("Warning! No memory to reload the file changed on disk, saving will overwrite it");
+}
+
+// Reloads the file after somebody else modified it. Instead of rebuilding
+// every row, the lines on disk are diffed against the rows in memory and
+// only the ranges that changed are replaced, so untouched rows keep their
+// render, highlight and undo history.
+//
+// The whole file is read at once, so with --max-memory a file that
+// wouldn't fit next to the rows is viewed with the paged viewer instead.
+// Without memory for the reload, the rows are kept as they were.
+void editorReload(struct stat* st) {
+    if (ec.max_memory && editorMemoryUsed() + st -> st_size > ec.max_memory) {
+        editorMemoryPager();
+        return;
+    }
+    int fd = open(ec.file_name, O_RDONLY);
+    if (fd == -1)
+        return;
+
+    size_t buf_cap = st -> st_size + 1;
+    size_t buf_len = 0;
+    char* buf = malloc(buf_cap);
+    ssize_t nread;
+    while (buf && (nread = read(fd, &buf[buf_len], buf_cap - buf_len)) != 0) {
+        if (nread == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        buf_len += nread;
+        if (buf_len == buf_cap) {
+            char* bigger = realloc(buf, buf_cap * 2);
+            if (bigger == NULL) {
+                free(buf);
+                buf = NULL;
+                break;
+            }
+            buf = bigger;
+            buf_cap *= 2;
+        }
+    }
+    fstat(fd, st);
+    close(fd);
+    if (buf == NULL) {
+        editorReloadFailed(st);
+        return;
+    }
+
+    ssize_t line_cap = 16;
+    ssize_t new_num_rows = 0;
+    char** lines = malloc(sizeof(char*) * line_cap);
+    ssize_t* lens = malloc(sizeof(ssize_t) * line_cap);
+    char* p = buf;
+    char* end = buf + buf_len;
+    int row_open = 0;
+    int no_memory = lines == NULL || lens == NULL;
+    while (!no_memory && p < end) {
+        char* new_line = memchr(p, '\n', end - p);
+        if (new_line == NULL) {
+            new_line = end;
+            row_open = 1;
+        }
+        if (new_num_rows == line_cap) {
+            char** more_lines = realloc(lines, sizeof(char*) * line_cap * 2);
+            if (more_lines)
+                lines = more_lines;
+            ssize_t* more_lens = more_lines ? realloc(lens, sizeof(ssize_t) * line_cap * 2) : NULL;
+            if (more_lens)
+                lens = more_lens;
+            if ((no_memory = more_lens == NULL))
+                break;
+            line_cap *= 2;
+        }
+        lines[new_num_rows] = p;
+        lens[new_num_rows] = new_line - p;
+        new_num_rows++;
+        p = new_line + 1;
+    }
+
+    ssize_t old_num_rows = ec.num_rows;
+    ssize_t* old_to_new = malloc(sizeof(ssize_t) * (old_num_rows + 1));
+    ssize_t* new_to_old = malloc(sizeof(ssize_t) * (new_num_rows + 1));
+    if (no_memory || old_to_new == NULL || new_to_old == NULL) {
+        free(new_to_old);
+        free(old_to_new);
+        free(lens);
+        free(lines);
+        free(buf);
+        editorReloadFailed(st);
+        return;
+    }
+    memset(old_to_new, -1, sizeof(ssize_t) * (old_num_rows + 1));
+    memset(new_to_old, -1, sizeof(ssize_t) * (new_num_rows + 1));
+
+    // Most of the time only a few lines change, so we first skip everything
+    // equal at the beginning and at the end.
+    ssize_t prefix = 0;
+    while (prefix < old_num_rows && prefix < new_num_rows &&
+        editorRowEquals(&ec.row[prefix], lines[prefix], lens[prefix])) {
+        old_to_new[prefix] = new_to_old[prefix] = prefix;
+        prefix++;
+    }
+    ssize_t suffix = 0;
+    while (suffix < old_num_rows - prefix && suffix < new_num_rows - prefix &&
+        editorRowEquals(&ec.row[old_num_rows - 1 - suffix],
+            lines[new_num_rows - 1 - suffix], lens[new_num_rows - 1 - suffix])) {
+        old_to_new[old_num_rows - 1 - suffix] = new_num_rows - 1 - suffix;
+        new_to_old[new_num_rows - 1 - suffix] = old_num_rows - 1 - suffix;
+        suffix++;
+    }
+    editorDiffMiddle(lines, lens, prefix, old_num_rows - suffix,
+        prefix, new_num_rows - suffix, old_to_new, new_to_old);
+
+    // Equal lines next to a match (blank lines, closing braces...) are
+    // not unique, so the diff didn't pair them. Growing every match
+    // downwards and then upwards catches them.
+    ssize_t old_y = -1;
+    for (ssize_t new_y = 0; new_y < new_num_rows; new_y++) {
+        if (new_to_old[new_y] != -1) {
+            old_y = new_to_old[new_y];
+        } else if (old_y != -2 && old_y + 1 < old_num_rows && old_to_new[old_y + 1] == -1 &&
+            editorRowEquals(&ec.row[old_y + 1], lines[new_y], lens[new_y])) {
+            old_y++;
+            old_to_new[old_y] = new_y;
+            new_to_old[new_y] = old_y;
+        } else {
+            old_y = -2;
+        }
+    }
+    old_y = old_num_rows;
+    for (ssize_t new_y = new_num_rows - 1; new_y >= 0; new_y--) {
+        if (new_to_old[new_y] != -1) {
+            old_y = new_to_old[new_y];
+        } else if (old_y != -2 && old_y > 0 && old_to_new[old_y - 1] == -1 &&
+            editorRowEquals(&ec.row[old_y - 1], lines[new_y], lens[new_y])) {
+            old_y--;
+            old_to_new[old_y] = new_y;
+            new_to_old[new_y] = old_y;
+        } else {
+            old_y = -2;
+        }
+    }
+    // The end of the file is always "matched", so actions done past the
+    // last row can still be mapped.
+    old_to_new[old_num_rows] = new_num_rows;
+
+    // Untouched rows are moved as they are, the others are built again.
+    // Until the old rows are freed, failing leaves them as they were.
+    editor_row* rows = malloc(sizeof(editor_row) * (new_num_rows + 1));
+    ssize_t changed = 0;
+    ssize_t y = 0;
+    for (; rows && y < new_num_rows; y++) {
+        if (new_to_old[y] != -1) {
+            rows[y] = ec.row[new_to_old[y]];
+            editorRowRelink(&rows[y]);
+        } else if (editorRowInit(&rows[y], y, lines[y], lens[y]) == -1) {
+            break;
+        } else {
+            changed++;
+        }
+        rows[y].idx = y;
+    }
+    if (y < new_num_rows) {
+        for (ssize_t j = 0; rows && j < y; j++) {
+            if (new_to_old[j] == -1)
+                editorFreeRow(&rows[j]);
+        }
+        free(rows);
+        free(new_to_old);
+        free(old_to_new);
+        free(lens);
+        free(lines);
+        free(buf);
+        editorReloadFailed(st);
+        return;
+    }
+    for (y = 0; y < old_num_rows; y++) {
+        if (old_to_new[y] == -1) {
+            editorFreeRow(&ec.row[y]);
+            changed++;
+        }
+    }
+    free(ec.row);
+    ec.row = rows;
+    ec.num_rows = new_num_rows;
+    ec.row_cap = new_num_rows + 1;
+    editorMetaInvalidate(0);
+
+    for (y = 0; y < new_num_rows; y++) {
+        int failed = 0;
+        if (new_to_old[y] == -1)
+            failed = editorUpdateRow(&ec.row[y]) == -1;
+        // An untouched row after a changed one may now start (or stop
+        // being) inside a multi-line comment.
+        else if (y == 0 ? new_to_old[y] != 0 : new_to_old[y - 1] != new_to_old[y] - 1)
+            failed = editorUpdateSyntax(&ec.row[y]) == -1;
+        if (failed)
+            editorMemoryFull();
+    }
+
+    ec.cursor_y = editorMapRow(old_to_new, old_num_rows, ec.cursor_y);
+    ec.row_offset = editorMapRow(old_to_new, old_num_rows, ec.row_offset);
+    if (ec.cursor_y < ec.num_rows && ec.cursor_x > ec.row[ec.cursor_y].size)
+        ec.cursor_x = ec.row[ec.cursor_y].size;
+    remapActions(old_to_new, old_num_rows);
+
+    ec.file_offset = buf_len;
+    ec.row_open = row_open;
+    ec.file_stat = *st;
+    editorSetStatusMessage("File changed on disk, %zd line%s reloaded", changed, changed != 1 ? "s" : "");
+
+    free(new_to_old);
+    free(old_to_new);
+    free(lens);
+    free(lines);
+    free(buf);
+}
+
+// Checks if the file was modified by somebody else. Returns true if the
+// rows had to be updated.
+int editorCheckFile() {
+    if (ec.file_name == NULL || !editorWatchChanged())
+        return 0;
+
+    struct stat st;
+    if (stat(ec.file_name, &st) == -1 || !fileStatChanged(&st, &ec.file_stat))
+        return 0;
+
+    if (ec.follow && st.st_ino == ec.file_stat.st_ino && st.st_size > ec.file_offset) {
+        editorFollow(&st);
+    } else if (ec.dirty) {
+        // We won't throw away the user's changes. Saving will overwrite
+        // the file.
+        ec.file_stat = st;
+        editorSetStatusMessage("Warning! File changed on disk, saving will overwrite it");
+    } else {
+        editorReload(&st);
+    }
+    return 1;
+}
+
+/*** Index cache section ***/
+
+// Returns the file's entry path in the cache directory (creating the
+// directory) or NULL if there's nowhere to put it.
+char* editorCachePath(struct stat* st) {
+    char dir[PATH_MAX];
+    char* xdg = getenv("XDG_CACHE_HOME");
+    char* home = getenv("HOME");
+    if (xdg && xdg[0])
+        snprintf(dir, sizeof(dir), "%s/tte", xdg);
+    else if (home && home[0])
+        snprintf(dir, sizeof(dir), "%s/.cache/tte", home);
+    else
+        return NULL;
+    // Creating the parent first, ~/.cache may not be there yet.
+    char* slash = strrchr(dir, '/');
+    *slash = '\0';
+    mkdir(dir, 0700);
+    *slash = '/';
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+        return NULL;
+
+    size_t path_len = strlen(dir) + 64;
+    char* path = malloc(path_len);
+    snprintf(path, path_len, "%s/%llx-%llx.idx", dir,
+        (unsigned long long) st -> st_dev, (unsigned long long) st -> st_ino);
+    return path;
+}
+
+// Hashes TTE_CACHE_SAMPLES blocks spread evenly over the file.
+uint64_t fileSampleHash(int fd, off_t size) {
+    char buf[TTE_CACHE_SAMPLE_SIZE];
+    uint64_t hash = (uint64_t) size;
+    for (int k = 0; k < TTE_CACHE_SAMPLES; k++) {
+        off_t offset = size > TTE_CACHE_SAMPLE_SIZE ?
+            (size - TTE_CACHE_SAMPLE_SIZE) / (TTE_CACHE_SAMPLES - 1) * k : 0;
+        ssize_t nread = pread(fd, buf, sizeof(buf), offset);
+        if (nread > 0)
+            hash = hash * 31 + editorHashLine(buf, nread);
+    }
+    return hash;
+}
+
+void cacheHeaderInit(struct cache_header* header, int fd, struct stat* st) {
+    memset(header, 0, sizeof(*header));
+    memcpy(header -> magic, "TTEIDX1", 8);
+    header -> ino = st -> st_ino;
+    header -> size = st -> st_size;
+    header -> mtime_sec = st -> st_mtime;
+#ifdef __linux__
+    header -> mtime_nsec = st -> st_mtim.tv_nsec;
+#endif
+    header -> sample_hash = fileSampleHash(fd, st -> st_size);
+}
+
+// Reads the entry for the open file into header, index and hl_state
+// (both malloc()ed, the caller frees them). Returns -1 if there's no
+// entry, or if it belongs to another version of the file.
+int editorCacheLoad(int fd, struct cache_header* header, off_t** index, signed char** hl_state) {
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < TTE_CACHE_MIN_SIZE)
+        return -1;
+    char* path = editorCachePath(&st);
+    if (path == NULL)
+        return -1;
+    FILE* cache = fopen(path, "r");
+    free(path);
+    if (cache == NULL)
+        return -1;
+
+    struct cache_header expected;
+    cacheHeaderInit(&expected, fd, &st);
+    int ok = fread(header, sizeof(*header), 1, cache) == 1 &&
+        memcmp(header -> magic, expected.magic, 8) == 0 &&
+        header -> ino == expected.ino && header -> size == expected.size &&
+        header -> mtime_sec == expected.mtime_sec && header -> mtime_nsec == expected.mtime_nsec &&
+        header -> sample_hash == expected.sample_hash &&
+        header -> index_len > 0 && header -> index_len <= st.st_size / TTE_PAGER_INDEX_STRIDE + 2;
+    *index = NULL;
+    *hl_state = NULL;
+    if (ok) {
+        *index = malloc(sizeof(off_t) * header -> index_len);
+        *hl_state = malloc(header -> index_len);
+        for (int64_t k = 0; ok && k < header -> index_len; k++) {
+            int64_t offset;
+            ok = fread(&offset, sizeof(offset), 1, cache) == 1;
+            (*index)[k] = offset;
+        }
+        ok = ok && fread(*hl_state, 1, header -> index_len, cache) == (size_t) header -> index_len;
+    }
+    fclose(cache);
+    if (!ok) {
+        free(*index);
+        free(*hl_state);
+        return -1;
+    }
+    return 0;
+}
+
+// Writes the entry for the file. It's written aside and renamed, so a
+// half written entry is never read.
+void editorCacheSave(int fd, struct cache_header* header, off_t* index, signed char* hl_state) {
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < TTE_CACHE_MIN_SIZE)
+        return;
+    char* path = editorCachePath(&st);
+    if (path == NULL)
+        return;
+    size_t tmp_len = strlen(path) + 16;
+    char* tmp = malloc(tmp_len);
+    snprintf(tmp, tmp_len, "%s.%d", path, (int) getpid());
+
+    struct cache_header saved = *header;
+    cacheHeaderInit(header, fd, &st);
+    header -> cursor_line = saved.cursor_line;
+    header -> cursor_x = saved.cursor_x;
+    header -> top_line = saved.top_line;
+    header -> total_lines = saved.total_lines;
+    header -> scan_line = saved.scan_line;
+    header -> scan_offset = saved.scan_offset;
+    header -> index_len = saved.index_len;
+
+    FILE* cache = fopen(tmp, "w");
+    if (cache) {
+        int ok = fwrite(header, sizeof(*header), 1, cache) == 1;
+        for (int64_t k = 0; ok && k < header -> index_len; k++) {
+            int64_t offset = index[k];
+            ok = fwrite(&offset, sizeof(offset), 1, cache) == 1;
+        }
+        ok = ok && fwrite(hl_state, 1, header -> index_len, cache) == (size_t) header -> index_len;
+        if (fclose(cache) == 0 && ok)
+            rename(tmp, path);
+        else
+            unlink(tmp);
+    }
+    free(tmp);
+    free(path);
+}
+
+// Called on exit: remembers the file if it's big enough to be worth it
+// and the rows are what's on disk.
+void editorCacheStore() {
+    if (ec.file_name == NULL)
+        return;
+    struct cache_header header;
+    memset(&header, 0, sizeof(header));
+    header.cursor_x = ec.cursor_x;
+    header.cursor_line = ec.row_base + ec.cursor_y;
+    header.top_line = ec.row_base + ec.row_offset;
+
+    if (ec.read_only) {
+        struct editor_pager* pg = &ec.pager;
+        header.total_lines = pg -> total_lines;
+        header.scan_line = pg -> scan_line;
+        header.scan_offset = pg -> scan_offset;
+        header.index_len = pg -> index_len;
+        editorCacheSave(fileno(pg -> file), &header, pg -> index, pg -> hl_state);
+        return;
+    }
+
+    // In the editor, the index is built from the rows, so they must be
+    // exactly the file.
+    struct stat st;
+    if (ec.dirty || ec.loader || ec.row_base != 0 || stat(ec.file_name, &st) == -1 ||
+        fileStatChanged(&st, &ec.file_stat) || st.st_size < TTE_CACHE_MIN_SIZE)
+        return;
+    int fd = open(ec.file_name, O_RDONLY);
+    if (fd == -1)
+        return;
+    // Lines ended by a newline, like the paged viewer counts them.
+    ssize_t lines = ec.num_rows - ec.row_open;
+    header.index_len = lines / TTE_PAGER_INDEX_STRIDE + 1;
+    off_t* index = malloc(sizeof(off_t) * header.index_len);
+    signed char* hl_state = malloc(header.index_len);
+    off_t offset = 0;
+    for (ssize_t y = 0; y <= lines; y++) {
+        if (y % TTE_PAGER_INDEX_STRIDE == 0) {
+            index[y / TTE_PAGER_INDEX_STRIDE] = offset;
+            hl_state[y / TTE_PAGER_INDEX_STRIDE] = y > 0 ? ec.row[y - 1].hl_open_comment : 0;
+        }
+        if (y < lines)
+            offset += ec.row[y].size + 1;
+    }
+    header.total_lines = ec.num_rows;
+    header.scan_line = lines;
+    header.scan_offset = offset;
+    editorCacheSave(fd, &header, index, hl_state);
+    free(hl_state);
+    free(index);
+    close(fd);
+}
+
+/*** Substring search section ***/
+
+// A query made ready to be looked for with searchFind(), or a regex
+// with searchMatch().
+struct search_matcher {
+    const char* query; // For a regex, its literal.
+    size_t len;
+    size_t shift[256]; // Boyer-Moore-Horspool shift for each byte.
+    struct regex* re; // NULL if it's not a regex.
+    struct regex_dfa* dfa;
+};
+
+void searchPrepare(struct search_matcher* m, const char* query) {
+    m -> query = query;
+    m -> re = NULL;
+    m -> dfa = NULL;
+    m -> len = strlen(query);
+    for (int c = 0; c < 256; c++)
+        m -> shift[c] = m -> len;
+    for (size_t j = 0; j + 1 < m -> len; j++)
+        m -> shift[(unsigned char) query[j]] = m -> len - 1 - j;
+}
+
+// Returns where the query first is in text, or -1.
+ssize_t searchFind(struct search_matcher* m, const char* text, size_t len) {
+    const char* q = m -> query;
+    size_t n = m -> len;
+    if (n == 0)
+        return 0;
+    if (n > len)
+        return -1;
+    if (n == 1) {
+        const char* p = memchr(text, q[0], len);
+        return p ? p - text : -1;
+    }
+    size_t i = 0;
+#ifdef __SSE2__
+    // 16 places at a time, only those where both the first and the last
+    // byte of the query are found are compared.
+    __m128i first = _mm_set1_epi8(q[0]);
+    __m128i last = _mm_set1_epi8(q[n - 1]);
+    for (; i + n - 1 + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*) (text + i));
+        __m128i b = _mm_loadu_si128((const __m128i*) (text + i + n - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            unsigned bit = __builtin_ctz(mask);
+            if (memcmp(text + i + bit + 1, q + 1, n - 2) == 0)
+                return i + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    // What's left (all of it without SSE2) with Boyer-Moore-Horspool.
+    while (i + n <= len) {
+        unsigned char c = text[i + n - 1];
+        if (c == (unsigned char) q[n - 1] && memcmp(text + i, q, n - 1) == 0)
+            return i;
+        i += m -> shift[c];
+    }
+    return -1;
+}
+
+/*** Regex section ***/
+
+// Regexes of the search prompt (Ctrl-R there toggles them): literals,
+// '.', [classes], \d \w \s (and \D \W \S), '^', '$', groups, '|', '*',
+// '+' and '?'. They are compiled to a Thompson NFA. Whether a row has a
+// match is told by a DFA built from it as it's walked, where the match
+// is by running the NFA itself. Neither backtracks, both take time
+// linear in the row.
+
+enum regex_op {
+    RE_BYTE = 0, // One byte of `set`.
+    RE_SPLIT, // Both to x and to y.
+    RE_JMP, // To x.
+    RE_BOL,
+    RE_EOL,
+    RE_MATCH
+};
+
+struct regex_inst {
+    int op;
+    int x;
+    int y;
+    unsigned char set[32];
+};
+
+// A DFA state: the NFA instructions (RE_BYTE and RE_MATCH ones) it's at.
+struct regex_state {
+    int* pcs;
+    int num_pcs;
+    unsigned match : 1; // A match ends here.
+    unsigned match_at_end : 1; // One would end here if the row did.
+};
+
+// Built lazily, so each thread has its own.
+struct regex_dfa {
+    struct regex_state* states;
+    // The state after each byte in each state (at state * 256 + byte),
+    // -1 if not built yet. Those the walk stops at (with a match or
+    // nowhere to go) are stored as -2 - state.
+    int* next;
+    int num_states;
+    int start; // -1 if not built yet.
+};
+
+struct regex {
+    char* pattern;
+    struct regex_inst* insts;
+    int num_insts;
+    // Longest string every match has, rows without it are skipped.
+    char literal[TTE_REGEX_LITERAL + 1];
+    struct regex_dfa dfa; // The main thread's.
+};
+
+enum regex_node_type {
+    RN_SET = 0,
+    RN_CAT,
+    RN_ALT,
+    RN_STAR,
+    RN_PLUS,
+    RN_QUEST,
+    RN_BOL,
+    RN_EOL,
+    RN_EMPTY
+};
+
+struct regex_node {
+    int type;
+    struct regex_node* a;
+    struct regex_node* b;
+    unsigned char set[32];
+};
+
+struct regex_parser {
+    const char* p;
+    int error;
+};
+
+void regexSetAdd(unsigned char* set, int from, int to) {
+    for (int c = from; c <= to; c++)
+        set[c / 8] |= 1 << (c % 8);
+}
+
+int regexSetHas(const unsigned char* set, unsigned char c) {
+    return set[c / 8] & (1 << (c % 8));
+}
+
+struct regex_node* regexNode(int type, struct regex_node* a, struct regex_node* b) {
+    struct regex_node* n = calloc(1, sizeof(struct regex_node));
+    if (n == NULL)
+        die("calloc");
+    n -> type = type;
+    n -> a = a;
+    n -> b = b;
+    return n;
+}
+
+void regexNodeFree(struct regex_node* n) {
+    if (n == NULL)
+        return;
+    regexNodeFree(n -> a);
+    regexNodeFree(n -> b);
+    free(n);
+}
+
+// Adds what \d, \w, \s (or their negation) stand for. Returns 0 if `c`
+// is none of them.
+int regexSetClass(unsigned char* set, char c) {
+    unsigned char class[32] = {0};
+    switch (tolower(c)) {
+        case 'd':
+            regexSetAdd(class, '0', '9');
+            break;
+        case 'w':
+            regexSetAdd(class, '0', '9');
+            regexSetAdd(class, 'a', 'z');
+            regexSetAdd(class, 'A', 'Z');
+            regexSetAdd(class, '_', '_');
+            break;
+        case 's':
+            regexSetAdd(class, '\t', '\r');
+            regexSetAdd(class, ' ', ' ');
+            break;
+        default:
+            return 0;
+    }
+    for (int j = 0; j < 32; j++)
+        set[j] |= isupper(c) ? ~class[j] : class[j];
+    return 1;
+}
+
+char regexEscape(char c) {
+    return c == 't' ? '\t' : c == 'n' ? '\n' : c == 'r' ? '\r' : c;
+}
+
+struct regex_node* regexParseAlt(struct regex_parser* ps);
+
+// [abc], [^abc], [a-z], with \d, \w, \s and escapes inside.
+struct regex_node* regexParseClass(struct regex_parser* ps) {
+    struct regex_node* n = regexNode(RN_SET, NULL, NULL);
+    int negate = *ps -> p == '^';
+    if (negate)
+        ps -> p++;
+    int first = 1;
+    while (*ps -> p && (*ps -> p != ']' || first)) {
+        first = 0;
+        unsigned char c = *ps -> p++;
+        if (c == '\\') {
+            if (*ps -> p == '\0')
+                break;
+            if (regexSetClass(n -> set, *ps -> p)) {
+                ps -> p++;
+                continue;
+            }
+            c = regexEscape(*ps -> p++);
+        }
+        unsigned char to = c;
+        if (ps -> p[0] == '-' && ps -> p[1] && ps -> p[1] != ']') {
+            to = ps -> p[1];
+            ps -> p += 2;
+            if (to == '\\' && *ps -> p)
+                to = regexEscape(*ps -> p++);
+            if (to < c) {
+                ps -> error = 1;
+                return n;
+            }
+        }
+        regexSetAdd(n -> set, c, to);
+    }
+    if (*ps -> p != ']') {
+        ps -> error = 1;
+        return n;
+    }
+    ps -> p++;
+    if (negate) {
+        for (int j = 0; j < 32; j++)
+            n -> set[j] = ~n -> set[j];
+    }
+    return n;
+}
+
+struct regex_node* regexParseAtom(struct regex_parser* ps) {
+    char c = *ps -> p++;
+    struct regex_node* n;
+    switch (c) {
+        case '(':
+            n = regexParseAlt(ps);
+            if (*ps -> p != ')')
+                ps -> error = 1;
+            else
+                ps -> p++;
+            return n;
+        case '[':
+            return regexParseClass(ps);
+        case '^':
+            return regexNode(RN_BOL, NULL, NULL);
+        case '$':
+            return regexNode(RN_EOL, NULL, NULL);
+        case '*':
+        case '+':
+        case '?':
+            // Nothing to repeat.
+            ps -> error = 1;
+            return regexNode(RN_EMPTY, NULL, NULL);
+    }
+    n = regexNode(RN_SET, NULL, NULL);
+    if (c == '.') {
+        regexSetAdd(n -> set, 0, 255);
+    } else if (c == '\\') {
+        if (*ps -> p == '\0')
+            ps -> error = 1;
+        else if (!regexSetClass(n -> set, *ps -> p))
+            regexSetAdd(n -> set, (unsigned char) regexEscape(*ps -> p), (unsigned char) regexEscape(*ps -> p));
+        if (*ps -> p)
+            ps -> p++;
+    } else {
+        regexSetAdd(n -> set, (unsigned char) c, (unsigned char) c);
+    }
+    return n;
+}
+
+struct regex_node* regexParseRepeat(struct regex_parser* ps) {
+    struct regex_node* n = regexParseAtom(ps);
+    while (*ps -> p == '*' || *ps -> p == '+' || *ps -> p == '?') {
+        char c = *ps -> p++;
+        n = regexNode(c == '*' ? RN_STAR : c == '+' ? RN_PLUS : RN_QUEST, n, NULL);
+    }
+    return n;
+}
+
+struct regex_node* regexParseCat(struct regex_parser* ps) {
+    struct regex_node* n = NULL;
+    while (*ps -> p && *ps -> p != '|' && *ps -> p != ')' && !ps -> error) {
+        struct regex_node* item = regexParseRepeat(ps);
+        n = n ? regexNode(RN_CAT, n, item) : item;
+    }
+    return n ? n : regexNode(RN_EMPTY, NULL, NULL);
+}
+
+struct regex_node* regexParseAlt(struct regex_parser* ps) {
+    struct regex_node* n = regexParseCat(ps);
+    while (*ps -> p == '|' && !ps -> error) {
+        ps -> p++;
+        n = regexNode(RN_ALT, n, regexParseCat(ps));
+    }
+    return n;
+}
+
+int regexEmit(struct regex* re, int op) {
+    if (re -> num_insts == TTE_REGEX_MAX_INSTS)
+        return -1;
+    if (re -> num_insts % 64 == 0) {
+        re -> insts = realloc(re -> insts, sizeof(struct regex_inst) * (re -> num_insts + 64));
+        if (re -> insts == NULL)
+            die("realloc");
+    }
+    struct regex_inst* inst = &re -> insts[re -> num_insts];
+    memset(inst, 0, sizeof(*inst));
+    inst -> op = op;
+    return re -> num_insts++;
+}
+
+// Thompson's construction, instructions are referred to by index since
+// the array moves as it grows. Returns -1 if there are too many.
+int regexCompileNode(struct regex* re, struct regex_node* n) {
+    int l1, l2;
+    switch (n -> type) {
+        case RN_SET:
+            if ((l1 = regexEmit(re, RE_BYTE)) == -1)
+                return -1;
+            memcpy(re -> insts[l1].set, n -> set, 32);
+            return 0;
+        case RN_CAT:
+            if (regexCompileNode(re, n -> a) == -1)
+                return -1;
+            return regexCompileNode(re, n -> b);
+        case RN_ALT:
+            if ((l1 = regexEmit(re, RE_SPLIT)) == -1)
+                return -1;
+            re -> insts[l1].x = l1 + 1;
+            if (regexCompileNode(re, n -> a) == -1 || (l2 = regexEmit(re, RE_JMP)) == -1)
+                return -1;
+            re -> insts[l1].y = l2 + 1;
+            if (regexCompileNode(re, n -> b) == -1)
+                return -1;
+            re -> insts[l2].x = re -> num_insts;
+            return 0;
+        case RN_STAR:
+            if ((l1 = regexEmit(re, RE_SPLIT)) == -1)
+                return -1;
+            re -> insts[l1].x = l1 + 1;
+            if (regexCompileNode(re, n -> a) == -1 || (l2 = regexEmit(re, RE_JMP)) == -1)
+                return -1;
+            re -> insts[l2].x = l1;
+            re -> insts[l1].y = re -> num_insts;
+            return 0;
+        case RN_PLUS:
+            l1 = re -> num_insts;
+            if (regexCompileNode(re, n -> a) == -1 || (l2 = regexEmit(re, RE_SPLIT)) == -1)
+                return -1;
+            re -> insts[l2].x = l1;
+            re -> insts[l2].y = l2 + 1;
+            return 0;
+        case RN_QUEST:
+            if ((l1 = regexEmit(re, RE_SPLIT)) == -1)
+                return -1;
+            re -> insts[l1].x = l1 + 1;
+            if (regexCompileNode(re, n -> a) == -1)
+                return -1;
+            re -> insts[l1].y = re -> num_insts;
+            return 0;
+        case RN_BOL:
+            return regexEmit(re, RE_BOL) == -1 ? -1 : 0;
+        case RN_EOL:
+            return regexEmit(re, RE_EOL) == -1 ? -1 : 0;
+    }
+    return 0;
+}
+
+// The only byte of a set, -1 if it has none or more.
+int regexSetByte(const unsigned char* set) {
+    int byte = -1;
+    for (int c = 0; c < 256; c++) {
+        if (regexSetHas(set, c)) {
+            if (byte != -1)
+                return -1;
+            byte = c;
+        }
+    }
+    return byte;
+}
+
+// Finds the longest run of single bytes in a row that every match has.
+// `run` is the one going on along the concatenation.
+void regexLiteral(struct regex_node* n, char* run, int* run_len, char* best, int* best_len) {
+    int byte;
+    switch (n -> type) {
+        case RN_CAT:
+            regexLiteral(n -> a, run, run_len, best, best_len);
+            regexLiteral(n -> b, run, run_len, best, best_len);
+            return;
+        case RN_BOL:
+        case RN_EOL:
+        case RN_EMPTY:
+            // They match no byte, the run goes on.
+            return;
+        case RN_SET:
+            if ((byte = regexSetByte(n -> set)) != -1 && *run_len < TTE_REGEX_LITERAL) {
+                run[(*run_len)++] = byte;
+                if (*run_len > *best_len) {
+                    memcpy(best, run, *run_len);
+                    *best_len = *run_len;
+                }
+                return;
+            }
+            break;
+        case RN_PLUS: {
+            // What's repeated is there at least once, on its own.
+            char inner[TTE_REGEX_LITERAL];
+            int inner_len = 0;
+            regexLiteral(n -> a, inner, &inner_len, best, best_len);
+            break;
+        }
+    }
+    *run_len = 0;
+}
+
+void regexDfaFree(struct regex_dfa* dfa) {
+    for (int s = 0; s < dfa -> num_states; s++)
+        free(dfa -> states[s].pcs);
+    free(dfa -> states);
+    free(dfa -> next);
+    dfa -> states = NULL;
+    dfa -> next = NULL;
+    dfa -> num_states = 0;
+    dfa -> start = -1;
+}
+
+void regexFree(struct regex* re) {
+    if (re == NULL)
+        return;
+    regexDfaFree(&re -> dfa);
+    free(re -> insts);
+    free(re -> pattern);
+    free(re);
+}
+
+// Returns NULL if the pattern isn't a valid regex (or a too big one).
+struct regex* regexCompile(const char* pattern) {
+    struct regex_parser ps = {pattern, 0};
+    struct regex_node* tree = regexParseAlt(&ps);
+    // A ')' without its '('.
+    if (*ps.p)
+        ps.error = 1;
+    struct regex* re = calloc(1, sizeof(struct regex));
+    if (re == NULL)
+        die("calloc");
+    re -> dfa.start = -1;
+    if (ps.error || regexCompileNode(re, tree) == -1 || regexEmit(re, RE_MATCH) == -1) {
+        regexNodeFree(tree);
+        regexFree(re);
+        return NULL;
+    }
+    char run[TTE_REGEX_LITERAL];
+    int run_len = 0;
+    int literal_len = 0;
+    regexLiteral(tree, run, &run_len, re -> literal, &literal_len);
+    re -> literal[literal_len] = '\0';
+    regexNodeFree(tree);
+    re -> pattern = strdup(pattern);
+    return re;
+}
+
+// The last regexes compiled, most recently used first. Typing a pattern
+// (or going back and forth in it) compiles each one once.
+struct regex* regexCached(const char* pattern) {
+    static struct regex* cache[TTE_REGEX_CACHE];
+    int k;
+    for (k = 0; k < TTE_REGEX_CACHE && cache[k]; k++) {
+        if (strcmp(cache[k] -> pattern, pattern) == 0)
+            break;
+    }
+    struct regex* re;
+    if (k < TTE_REGEX_CACHE && cache[k]) {
+        re = cache[k];
+    } else {
+        if ((re = regexCompile(pattern)) == NULL)
+            return NULL;
+        if (k == TTE_REGEX_CACHE)
+            regexFree(cache[--k]);
+    }
+    memmove(&cache[1], &cache[0], sizeof(struct regex*) * k);
+    cache[0] = re;
+    return re;
+}
+
+// Adds pc, and what it leads to without reading a byte, to the list if
+// it's not `on` it yet. The order of the list is the order they were
+// added in, which is what makes the leftmost match win in regexFind().
+void regexClosure(struct regex* re, int pc, int bol, int eol, int* list, int* num, unsigned char* on) {
+    while (!on[pc]) {
+        on[pc] = 1;
+        struct regex_inst* inst = &re -> insts[pc];
+        switch (inst -> op) {
+            case RE_BYTE:
+            case RE_MATCH:
+                list[(*num)++] = pc;
+                return;
+            case RE_SPLIT:
+                regexClosure(re, inst -> x, bol, eol, list, num, on);
+                pc = inst -> y;
+                break;
+            case RE_JMP:
+                pc = inst -> x;
+                break;
+            case RE_BOL:
+                if (!bol)
+                    return;
+                pc++;
+                break;
+            case RE_EOL:
+                if (!eol)
+                    return;
+                pc++;
+                break;
+        }
+    }
+}
+
+// Finds the leftmost match starting at or after `from` (the longest of
+// those that start there), by running the NFA with one thread for each
+// place a match may start. Returns where it starts and sets *match_len,
+// or returns -1.
+ssize_t regexFind(struct regex* re, const char* text, size_t len, size_t from, ssize_t* match_len) {
+    int n = re -> num_insts;
+    int* lists = malloc(sizeof(int) * n * 4);
+    unsigned char* on = calloc(n, 1);
+    if (lists == NULL || on == NULL)
+        die("malloc");
+    // Each thread is at an instruction and has the start of its match.
+    int* clist = lists;
+    int* cstart = clist + n;
+    int* nlist = cstart + n;
+    int* nstart = nlist + n;
+    int cn = 0;
+    ssize_t best = -1;
+    ssize_t best_end = -1;
+    for (size_t i = from; ; i++) {
+        // A new thread starts here, unless a match started before.
+        if (best == -1) {
+            int k = cn;
+            regexClosure(re, 0, i == 0, i == len, clist, &cn, on);
+            for (; k < cn; k++)
+                cstart[k] = i;
+        }
+        if (cn == 0 && best != -1)
+            break;
+        for (int k = 0; k < cn; k++) {
+            if (re -> insts[clist[k]].op == RE_MATCH &&
+                (best == -1 || cstart[k] < best || (cstart[k] == best && (ssize_t) i > best_end))) {
+                best = cstart[k];
+                best_end = i;
+            }
+        }
+        if (i == len)
+            break;
+        memset(on, 0, n);
+        int nn = 0;
+        for (int k = 0; k < cn; k++) {
+            struct regex_inst* inst = &re -> insts[clist[k]];
+            // Matches starting later can't win anymore.
+            if (best != -1 && cstart[k] > best)
+                continue;
+            if (inst -> op == RE_BYTE && regexSetHas(inst -> set, text[i])) {
+                int j = nn;
+                regexClosure(re, clist[k] + 1, 0, i + 1 == len, nlist, &nn, on);
+                for (; j < nn; j++)
+                    nstart[j] = cstart[k];
+            }
+        }
+        int* swap = clist;
+        clist = nlist;
+        nlist = swap;
+        swap = cstart;
+        cstart = nstart;
+        nstart = swap;
+        cn = nn;
+    }
+    free(lists);
+    free(on);
+    if (best != -1)
+        *match_len = best_end - best;
+    return best;
+}
+
+int regexPcsCompare(const void* a, const void* b) {
+    return *(const int*) a - *(const int*) b;
+}
+
+// The state for the NFA at the kernel instructions (those right after a
+// byte), with a match allowed to start anywhere. Returns -1 if there's
+// no memory for it.
+int regexDfaState(struct regex* re, struct regex_dfa* dfa, int* kernel, int num_kernel, int bol) {
+    int n = re -> num_insts;
+    int* list = malloc(sizeof(int) * n);
+    int* end_list = malloc(sizeof(int) * n);
+    unsigned char* on = calloc(n, 1);
+    if (list == NULL || end_list == NULL || on == NULL)
+        die("malloc");
+    int num = 0;
+    for (int k = 0; k < num_kernel; k++)
+        regexClosure(re, kernel[k], bol, 0, list, &num, on);
+    regexClosure(re, 0, bol, 0, list, &num, on);
+    int num_end = 0;
+    memset(on, 0, n);
+    for (int k = 0; k < num_kernel; k++)
+        regexClosure(re, kernel[k], bol, 1, end_list, &num_end, on);
+    regexClosure(re, 0, bol, 1, end_list, &num_end, on);
+    int match_at_end = 0;
+    for (int k = 0; k < num_end; k++)
+        match_at_end |= re -> insts[end_list[k]].op == RE_MATCH;
+    free(end_list);
+    free(on);
+    qsort(list, num, sizeof(int), regexPcsCompare);
+
+    for (int s = 0; s < dfa -> num_states; s++) {
+        struct regex_state* st = &dfa -> states[s];
+        if (st -> num_pcs == num && st -> match_at_end == match_at_end &&
+            memcmp(st -> pcs, list, sizeof(int) * num) == 0) {
+            free(list);
+            return s;
+        }
+    }
+    // Too many, they are all built again from now on.
+    if (dfa -> num_states == TTE_REGEX_DFA_STATES)
+        regexDfaFree(dfa);
+    if (dfa -> states == NULL) {
+        dfa -> states = malloc(sizeof(struct regex_state) * TTE_REGEX_DFA_STATES);
+        dfa -> next = malloc(sizeof(int) * 256 * TTE_REGEX_DFA_STATES);
+        if (dfa -> states == NULL || dfa -> next == NULL) {
+            free(list);
+            regexDfaFree(dfa);
+            return -1;
+        }
+    }
+    struct regex_state* st = &dfa -> states[dfa -> num_states];
+    st -> pcs = list;
+    st -> num_pcs = num;
+    st -> match = 0;
+    for (int k = 0; k < num; k++)
+        st -> match |= re -> insts[list[k]].op == RE_MATCH;
+    st -> match_at_end = match_at_end;
+    for (int c = 0; c < 256; c++)
+        dfa -> next[dfa -> num_states * 256 + c] = -1;
+    return dfa -> num_states++;
+}
+
+// A match, or nowhere to go (like after the first byte for a regex with
+// '^'), the rest of the row doesn't matter.
+int regexDfaStops(struct regex_state* st) {
+    return st -> match || (st -> num_pcs == 0 && !st -> match_at_end);
+}
+
+// Builds the state after byte c in state s.
+int regexDfaStep(struct regex* re, struct regex_dfa* dfa, int s, unsigned char c) {
+    struct regex_state* st = &dfa -> states[s];
+    int* kernel = malloc(sizeof(int) * (st -> num_pcs + 1));
+    if (kernel == NULL)
+        die("malloc");
+    int num_kernel = 0;
+    for (int k = 0; k < st -> num_pcs; k++) {
+        struct regex_inst* inst = &re -> insts[st -> pcs[k]];
+        if (inst -> op == RE_BYTE && regexSetHas(inst -> set, c))
+            kernel[num_kernel++] = st -> pcs[k] + 1;
+    }
+    int num_states = dfa -> num_states;
+    int next = regexDfaState(re, dfa, kernel, num_kernel, 0);
+    // Unless the states were thrown away meanwhile.
+    if (next != -1 && dfa -> num_states >= num_states)
+        dfa -> next[s * 256 + c] = regexDfaStops(&dfa -> states[next]) ? -2 - next : next;
+    free(kernel);
+    return next;
+}
+
+// 1 if there's a match anywhere in the text, -1 if it couldn't tell.
+int regexDfaHas(struct regex* re, struct regex_dfa* dfa, const char* text, size_t len) {
+    if (dfa -> start == -1 && (dfa -> start = regexDfaState(re, dfa, NULL, 0, 1)) == -1)
+        return -1;
+    int s = dfa -> start;
+    struct regex_state* states = dfa -> states;
+    int* table = dfa -> next;
+    if (states[s].match)
+        return 1;
+    for (size_t i = 0; i < len; i++) {
+        int next = table[s * 256 + (unsigned char) text[i]];
+        if (next >= 0) {
+            s = next;
+            continue;
+        }
+        if (next == -1) {
+            int num_states = dfa -> num_states;
+            if ((next = regexDfaStep(re, dfa, s, text[i])) == -1)
+                return -1;
+            // The start state went with the others.
+            if (dfa -> num_states < num_states)
+                dfa -> start = -1;
+            states = dfa -> states;
+            table = dfa -> next;
+        } else {
+            next = -2 - next;
+        }
+        s = next;
+        if (regexDfaStops(&states[s]))
+            return states[s].match;
+    }
+    return states[s].match || states[s].match_at_end;
+}
+
+// Makes the matcher look for a regex, with its literal as the query.
+// Returns -1 if it doesn't compile.
+int searchPrepareRegex(struct search_matcher* m, const char* pattern) {
+    struct regex* re = regexCached(pattern);
+    if (re == NULL)
+        return -1;
+    searchPrepare(m, re -> literal);
+    m -> re = re;
+    m -> dfa = &re -> dfa;
+    return 0;
+}
+
+// Where the first match at or after `from` is, setting *match_len, or -1.
+ssize_t searchMatch(struct search_matcher* m, const char* text, size_t len, size_t from, ssize_t* match_len) {
+    if (from > len)
+        return -1;
+    if (m -> re == NULL) {
+        ssize_t found = searchFind(m, text + from, len - from);
+        *match_len = m -> len;
+        return found == -1 ? -1 : (ssize_t) from + found;
+    }
+    // The literal and the DFA tell cheaply if the row has a match at all,
+    // only then the NFA finds where.
+    if (from == 0 && ((m -> len && searchFind(m, text, len) == -1) || regexDfaHas(m -> re, m -> dfa, text, len) == 0))
+        return -1;
+    return regexFind(m -> re, text, len, from, match_len);
+}
+
+// Where to look for the next match in a row after one. Matches of a
+// query may overlap, those of a regex don't (past an empty one, it moves
+// on a byte).
+ssize_t searchNext(struct search_matcher* m, ssize_t found, ssize_t len) {
+    return found + (m -> re && len > 0 ? len : 1);
+}
+
+/*** Pager section ***/
+
+// Drops the pages between `from` and `to` from the page cache, except
+// the ones around the window: we'll read those again soon, the rest of
+// a huge file would only push other programs' data out of the cache.
+void editorPagerDrop(off_t from, off_t to) {
+    struct editor_pager* pg = &ec.pager;
+    if (to <= from)
+        return;
+    off_t span = pg -> window_end - pg -> window_start;
+    off_t keep_start = pg -> window_start - span;
+    off_t keep_end = pg -> window_end + span;
+    int fd = fileno(pg -> file);
+    if (from < keep_start)
+        fileAdvise(fd, from, (to < keep_start ? to : keep_start) - from, POSIX_FADV_DONTNEED);
+    if (to > keep_end)
+        fileAdvise(fd, from > keep_end ? from : keep_end, to - (from > keep_end ? from : keep_end), POSIX_FADV_DONTNEED);
+}
+
+// Counts lines forward from the offset, returning where the next line
+// starts after skipping `lines` of them, or -1 if EOF comes first.
+off_t editorPagerSkipLines(off_t offset, ssize_t lines) {
+    char* buf = malloc(TTE_READ_CHUNK);
+    int fd = fileno(ec.pager.file);
+    off_t dropped = offset;
+    while (lines > 0) {
+        ssize_t nread = pread(fd, buf, TTE_READ_CHUNK, offset);
+        if (nread <= 0) {
+            if (nread == -1 && errno == EINTR)
+                continue;
+            offset = -1;
+            break;
+        }
+        if (offset - dropped >= TTE_PAGER_DROP_BYTES) {
+            editorPagerDrop(dropped, offset);
+            dropped = offset;
+        }
+        char* p = buf;
+        char* end = buf + nread;
+        char* new_line;
+        while (lines > 0 && (new_line = memchr(p, '\n', end - p)) != NULL) {
+            lines--;
+            p = new_line + 1;
+        }
+        offset += p - buf;
+        if (lines > 0)
+            offset += end - p;
+    }
+    free(buf);
+    if (offset != -1)
+        editorPagerDrop(dropped, offset);
+    return offset;
+}
+
+// A new line starts at the offset, right after the last one indexed.
+void editorPagerIndexAdd(off_t offset) {
+    struct editor_pager* pg = &ec.pager;
+    pg -> scan_line++;
+    pg -> scan_offset = offset;
+    if (pg -> scan_line % TTE_PAGER_INDEX_STRIDE == 0) {
+        if (pg -> index_len == pg -> index_cap) {
+            pg -> index_cap *= 2;
+            pg -> index = realloc(pg -> index, sizeof(off_t) * pg -> index_cap);
+            pg -> hl_state = realloc(pg -> hl_state, pg -> index_cap);
+        }
+        pg -> hl_state[pg -> index_len] = -1;
+        pg -> index[pg -> index_len++] = pg -> scan_offset;
+    }
+}
+
+// Indexes the file until `line` is reached (or the end of the file).
+void editorPagerIndexTo(ssize_t line) {
+    struct editor_pager* pg = &ec.pager;
+    if (pg -> total_lines != -1 || pg -> scan_line >= line)
+        return;
+
+    char* buf = malloc(TTE_READ_CHUNK);
+    int fd = fileno(pg -> file);
+    off_t read_offset = pg -> scan_offset;
+    off_t dropped = read_offset;
+    while (pg -> scan_line < line) {
+        ssize_t nread = pread(fd, buf, TTE_READ_CHUNK, read_offset);
+        if (nread == -1 && errno == EINTR)
+            continue;
+        if (read_offset - dropped >= TTE_PAGER_DROP_BYTES) {
+            editorPagerDrop(dropped, read_offset);
+            dropped = read_offset;
+        }
+        if (nread <= 0) {
+            // Bytes after the last newline are a line too.
+            pg -> total_lines = pg -> scan_line + (read_offset > pg -> scan_offset);
+            break;
+        }
+        char* p = buf;
+        char* end = buf + nread;
+        char* new_line;
+        while (pg -> scan_line < line && (new_line = memchr(p, '\n', end - p)) != NULL) {
+            p = new_line + 1;
+            editorPagerIndexAdd(read_offset + (p - buf));
+        }
+        read_offset += nread;
+    }
+    editorPagerDrop(dropped, read_offset);
+    free(buf);
+}
+
+// Returns the offset where the line starts, -1 if it's past the end.
+off_t editorPagerLineOffset(ssize_t line) {
+    if (line < 0)
+        return -1;
+    editorPagerIndexTo(line);
+    if (ec.pager.scan_line == line)
+        return ec.pager.scan_offset;
+    if (ec.pager.total_lines != -1 && line >= ec.pager.total_lines)
+        return -1;
+    ssize_t k = line / TTE_PAGER_INDEX_STRIDE;
+    return editorPagerSkipLines(ec.pager.index[k], line - k * TTE_PAGER_INDEX_STRIDE);
+}
+
+// Replaces the rows in memory with the window starting at `first_line`.
+void editorPagerLoad(ssize_t first_line) {
+    struct editor_pager* pg = &ec.pager;
+    off_t offset = editorPagerLineOffset(first_line);
+    if (offset == -1) {
+        // Past the end, the window will hold the last lines then.
+        first_line = pg -> total_lines - TTE_PAGER_WINDOW_PAGES * ec.screen_rows;
+        if (first_line < 0)
+            first_line = 0;
+        offset = editorPagerLineOffset(first_line);
+        if (offset == -1)
+            offset = 0;
+    }
+
+    // Without long rows, every buffer of the window is in a slab, and
+    // the slabs can be given back without looking at the rows.
+    if (ec.slabs.num_big == 0) {
+        rowFreeAll();
+    } else {
+        for (ssize_t j = 0; j < ec.num_rows; j++)
+            editorFreeRow(&ec.row[j]);
+    }
+    free(ec.row);
+    ec.row = NULL;
+    ec.num_rows = 0;
+    ec.row_cap = 0;
+    editorMetaInvalidate(0);
+
+    // The window may start inside a multi-line comment. If we know the
+    // state at an index entry shortly before it, highlighting starts
+    // there and the lines before the window are dropped afterwards.
+    // Otherwise we guess it doesn't.
+    ssize_t from = first_line;
+    int hl_known = 0;
+    ec.hl_base_open = 0;
+    if (ec.syntax && ec.syntax -> multiline_comment_start) {
+        ssize_t k = first_line / TTE_PAGER_INDEX_STRIDE;
+        if (k >= pg -> index_len)
+            k = pg -> index_len - 1;
+        for (ssize_t j = k; j >= 0 && j > k - TTE_PAGER_HL_LOOKBACK && !hl_known; j--) {
+            if (pg -> hl_state[j] != -1) {
+                from = j * TTE_PAGER_INDEX_STRIDE;
+                offset = pg -> index[j];
+                ec.hl_base_open = pg -> hl_state[j];
+                hl_known = 1;
+            }
+        }
+    }
+    ec.row_base = from;
+
+    fseeko(pg -> file, offset, SEEK_SET);
+    char* line = NULL;
+    size_t line_cap = 0;
+    ssize_t line_len;
+    while (ec.num_rows < first_line - from + TTE_PAGER_WINDOW_PAGES * ec.screen_rows) {
+        if ((line_len = getline(&line, &line_cap, pg -> file)) == -1) {
+            // The end of the file: the index is taken there too, searches
+            // and jumps rely on it covering every line once the total is
+            // known.
+            editorPagerIndexTo(SSIZE_MAX);
+            break;
+        }
+        if (line_len > 0 && line[line_len - 1] == '\n')
+            line_len--;
+        editorInsertRow(ec.num_rows, line, line_len);
+    }
+    free(line);
+    ec.dirty = 0;
+
+    // What we learnt on the way is remembered for the next time.
+    for (ssize_t y = 0; hl_known && y < ec.num_rows; y++) {
+        ssize_t k = (from + y) / TTE_PAGER_INDEX_STRIDE;
+        if ((from + y) % TTE_PAGER_INDEX_STRIDE == 0 && k < pg -> index_len && pg -> hl_state[k] == -1)
+            pg -> hl_state[k] = y > 0 ? ec.row[y - 1].hl_open_comment : ec.hl_base_open;
+    }
+    ssize_t lead = first_line - from;
+    if (lead > ec.num_rows)
+        lead = ec.num_rows;
+    if (lead > 0) {
+        ec.hl_base_open = ec.row[lead - 1].hl_open_comment;
+        for (ssize_t y = 0; y < lead; y++)
+            editorFreeRow(&ec.row[y]);
+        memmove(ec.row, &ec.row[lead], sizeof(editor_row) * (ec.num_rows - lead));
+        ec.num_rows -= lead;
+        editorMetaInvalidate(0);
+        for (ssize_t y = 0; y < ec.num_rows; y++) {
+            ec.row[y].idx = y;
+            editorRowRelink(&ec.row[y]);
+        }
+        ec.row_base += lead;
+    }
+
+    // Scrolling from here will read the bytes right before and after the
+    // window, so they are read ahead while the user looks at this one.
+    pg -> window_start = offset;
+    pg -> window_end = ftello(pg -> file);
+    off_t span = pg -> window_end - pg -> window_start;
+    int fd = fileno(pg -> file);
+    fileAdvise(fd, pg -> window_start - span, span, POSIX_FADV_WILLNEED);
+    fileAdvise(fd, pg -> window_end, span, POSIX_FADV_WILLNEED);
+}
+
+// Called before drawing: if the cursor got close to one of the window
+// edges, the window is moved so the cursor is centered again.
+void editorPagerSync() {
+    int window = TTE_PAGER_WINDOW_PAGES * ec.screen_rows;
+    int margin = 2 * ec.screen_rows;
+    int at_end = ec.pager.total_lines != -1 && ec.row_base + ec.num_rows >= ec.pager.total_lines;
+    if ((ec.cursor_y >= margin || ec.row_base == 0) &&
+        (ec.cursor_y < ec.num_rows - margin || at_end))
+        return;
+
+    ssize_t first_line = ec.row_base + ec.cursor_y - window / 2;
+    if (first_line < 0)
+        first_line = 0;
+    ssize_t old_base = ec.row_base;
+    editorPagerLoad(first_line);
+    ec.cursor_y -= ec.row_base - old_base;
+    ec.row_offset -= ec.row_base - old_base;
+    if (ec.cursor_y < 0)
+        ec.cursor_y = 0;
+    if (ec.cursor_y > ec.num_rows)
+        ec.cursor_y = ec.num_rows;
+    if (ec.row_offset < 0)
+        ec.row_offset = 0;
+}
+
+// Searches the file for the query, starting at `line` and going in
+// `direction`, wrapping around at the ends. The file is streamed, so
+// nothing besides the index is kept. Returns the line or -1.
+ssize_t editorPagerFind(char* query, ssize_t line, int direction) {
+    struct editor_pager* pg = &ec.pager;
+    char* buf = NULL;
+    size_t buf_cap = 0;
+    ssize_t buf_len = 0;
+    ssize_t found = -1;
+    ssize_t match_len;
+    struct search_matcher matcher;
+    if (!ec.search.regex)
+        searchPrepare(&matcher, query);
+    else if (searchPrepareRegex(&matcher, query) == -1)
+        return -1;
+
+    if (direction == 1) {
+        // Forward it's just reading lines, the second pass is the wrap
+        // around from the beginning.
+        for (int pass = 0; pass < 2 && found == -1; pass++) {
+            ssize_t from = pass ? 0 : line;
+            off_t offset = editorPagerLineOffset(from);
+            if (offset == -1)
+                continue;
+            fseeko(pg -> file, offset, SEEK_SET);
+            off_t dropped = offset;
+            ssize_t y;
+            for (y = from; (pass == 0 || y < line) &&
+                (buf_len = getline(&buf, &buf_cap, pg -> file)) != -1; y++) {
+                offset += buf_len;
+                // Lines past the index are indexed on the way, so the
+                // search doesn't have to be the only one reading them.
+                if (y == pg -> scan_line && pg -> total_lines == -1 && buf[buf_len - 1] == '\n')
+                    editorPagerIndexAdd(offset);
+                if (offset - dropped >= TTE_PAGER_DROP_BYTES) {
+                    editorPagerDrop(dropped, offset);
+                    dropped = offset;
+                }
+                if (searchMatch(&matcher, buf, buf_len - (buf[buf_len - 1] == '\n'), 0, &match_len) != -1) {
+                    found = y;
+                    break;
+                }
+            }
+            if (found == -1 && buf_len == -1 && pg -> total_lines == -1 && y >= pg -> scan_line)
+                pg -> total_lines = y;
+            editorPagerDrop(dropped, offset);
+        }
+    } else {
+        // Backwards we read every block between two index entries, from
+        // the last one down to the first, and keep the last match in it.
+        editorPagerIndexTo(line);
+        if (line < 0) {
+            editorPagerIndexTo(SSIZE_MAX);
+            line = pg -> total_lines - 1;
+        }
+        for (int pass = 0; pass < 2 && found == -1; pass++) {
+            ssize_t to = line;
+            ssize_t stop = -1;
+            if (pass) {
+                editorPagerIndexTo(SSIZE_MAX);
+                stop = line;
+                to = pg -> total_lines - 1;
+            }
+            for (ssize_t k = to / TTE_PAGER_INDEX_STRIDE; k >= 0 && found == -1; k--) {
+                ssize_t y = k * TTE_PAGER_INDEX_STRIDE;
+                if (y + TTE_PAGER_INDEX_STRIDE <= stop)
+                    break;
+                fseeko(pg -> file, pg -> index[k], SEEK_SET);
+                off_t offset = pg -> index[k];
+                for (; y <= to && y < (k + 1) * TTE_PAGER_INDEX_STRIDE &&
+                    (buf_len = getline(&buf, &buf_cap, pg -> file)) != -1; y++) {
+                    offset += buf_len;
+                    if (y > stop && searchMatch(&matcher, buf, buf_len - (buf[buf_len - 1] == '\n'), 0, &match_len) != -1)
+                        found = y;
+                }
+                editorPagerDrop(pg -> index[k], offset);
+            }
+        }
+    }
+    free(buf);
+    return found;
+}
+
+void editorPagerOpen(char* file_name) {
+    free(ec.file_name);
+    ec.file_name = strdup(file_name);
+
+    editorSelectSyntaxHighlight();
+
+    ec.pager.file = fopen(file_name, "r");
+    if (!ec.pager.file)
+        die("Failed to open the file");
+
+    ec.pager.window_start = 0;
+    ec.pager.window_end = 0;
+    // Indexing and searching go through the file from start to end.
+    fileAdvise(fileno(ec.pager.file), 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    struct cache_header cache;
+    if (editorCacheLoad(fileno(ec.pager.file), &cache, &ec.pager.index, &ec.pager.hl_state) == 0) {
+        // We have been here before: the index is reused and we go back
+        // to where the cursor was.
+        ec.pager.index_len = ec.pager.index_cap = cache.index_len;
+        ec.pager.scan_line = cache.scan_line;
+        ec.pager.scan_offset = cache.scan_offset;
+        ec.pager.total_lines = cache.total_lines;
+        editorPagerLoad(cache.top_line);
+        ec.row_offset = cache.top_line - ec.row_base;
+        ec.cursor_y = cache.cursor_line - ec.row_base;
+        if (ec.row_offset < 0 || ec.row_offset > ec.num_rows)
+            ec.row_offset = 0;
+        if (ec.cursor_y < 0 || ec.cursor_y > ec.num_rows)
+            ec.cursor_y = ec.row_offset;
+        ec.cursor_x = ec.cursor_y < ec.num_rows && cache.cursor_x <= ec.row[ec.cursor_y].size ? cache.cursor_x : 0;
+        return;
+    }
+
+    ec.pager.index_cap = 64;
+    ec.pager.index = malloc(sizeof(off_t) * ec.pager.index_cap);
+    ec.pager.hl_state = malloc(ec.pager.index_cap);
+    ec.pager.index[0] = 0;
+    ec.pager.hl_state[0] = 0;
+    ec.pager.index_len = 1;
+    ec.pager.scan_line = 0;
+    ec.pager.scan_offset = 0;
+    ec.pager.total_lines = -1;
+    editorPagerLoad(0);
+}
+
+/*** Search section ***/
+
+// The query as it's being typed, and for each length of it the line its
+// first match was on (-1 if there's none, -2 if it's not known). A longer
+// query can't match before its prefix did, or at all if the prefix
+// didn't. Deleting a char goes back to where the shorter query matched.
+struct search_typed {
+    char* query;
+    ssize_t* match;
+    size_t cap;
+};
+
+// Where to start looking for the query: -1 if it can't be anywhere,
+// -2 if it has to be looked for everywhere, the line otherwise.
+ssize_t searchTypedFrom(struct search_typed* st, char* query) {
+    if (st -> query == NULL)
+        return -2;
+    size_t len = strlen(query);
+    size_t typed_len = strlen(st -> query);
+    size_t shared = len < typed_len ? len : typed_len;
+    if (strncmp(query, st -> query, shared) != 0)
+        return -2;
+    return st -> match[shared];
+}
+
+// Remembers where the query matched, -1 if nowhere.
+void searchTypedSet(struct search_typed* st, char* query, ssize_t line) {
+    size_t len = strlen(query);
+    if (len + 1 > st -> cap) {
+        st -> cap = len + 16;
+        st -> match = realloc(st -> match, sizeof(ssize_t) * st -> cap);
+    }
+    // Only the lengths it shares with the last query are still known.
+    size_t keep = 0;
+    if (st -> query) {
+        size_t typed_len = strlen(st -> query);
+        size_t shared = len < typed_len ? len : typed_len;
+        if (strncmp(query, st -> query, shared) == 0)
+            keep = shared + 1;
+    }
+    for (size_t j = keep; j < len; j++)
+        st -> match[j] = -2;
+    st -> match[len] = line;
+    free(st -> query);
+    st -> query = strdup(query);
 }
 
-void editorRowDelChar(editor_row* row, int at) {
-    if (at < 0 || at >= row -> size)
-        return;
-    // Overwriting the deleted character with the characters that come
-    // after it.
-    memmove(&row -> chars[at], &row -> chars[at + 1], row -> size - at);
-    row -> size--;
-    editorUpdateRow(row);
-    ec.dirty++;
+void searchTypedClear(struct search_typed* st) {
+    free(st -> query);
+    st -> query = NULL;
 }
 
-void editorRowDelString(editor_row* row, int at, int len) {
-    if (at < 0 || (at + len - 1) >= row -> size)
-        return;
-    // Overwriting the deleted string with the characters that come
-    // after it.
-    memmove(&row -> chars[at], &row -> chars[at + len], row -> size - (at + len) + 1);
-    row -> size -= len;
-    editorUpdateRow(row);
-    ec.dirty += len;
+void searchIndexClear() {
+    struct search_index* si = &ec.search;
+    searchPoolStop();
+    free(si -> query);
+    si -> query = NULL;
+    si -> num_hits = 0;
+    si -> match_y = -1;
+    si -> bad = 0;
 }
 
-void editorRowInsertString(editor_row* row, int at, char* str) {
-    int len = strlen(str);
-    if (at < 0 || at > row -> size)
+// Starts over with a new query. If it only grew, the matches of the
+// shorter one are all it can have (not so for a regex). `none` tells it
+// has no matches at all. The paged viewer has no rows for the whole
+// file, so no index.
+void searchIndexStart(char* query, int none) {
+    struct search_index* si = &ec.search;
+    size_t len = strlen(query);
+    size_t old_len = si -> query ? strlen(si -> query) : 0;
+    int narrow = si -> query && si -> done && !si -> full && len > old_len && !si -> regex &&
+        strncmp(query, si -> query, old_len) == 0 && !strchr(query, ' ');
+    ssize_t num_hits = si -> num_hits;
+    searchIndexClear();
+    si -> bad = si -> regex && regexCached(query) == NULL;
+    if (ec.read_only || len == 0 || si -> bad)
         return;
-    row->chars = realloc(row->chars, row->size + strlen(str) + 2);
-    // Move 'after-at' part of string content to the end.
-    memmove(&row -> chars[at + len], &row -> chars[at], row -> size - at);
-    // Copy contents of str into the created space.
-    memcpy(&row -> chars[at], str, strlen(str));
-    row -> size += len;
-    editorUpdateRow(row);
-    ec.dirty += len;
+    si -> query = strdup(query);
+    si -> done = 1;
+    si -> full = 0;
+    if (none)
+        return;
+    if (!narrow) {
+        si -> next_y = 0;
+        si -> done = 0;
+        return;
+    }
+    si -> num_hits = num_hits;
+    ssize_t kept = 0;
+    for (ssize_t k = 0; k < si -> num_hits; k++) {
+        struct search_hit* hit = &si -> hits[k];
+        editor_row* row = &ec.row[hit -> y];
+        if (hit -> x + (ssize_t) len <= row -> size && memcmp(editorRowText(row) + hit -> x, query, len) == 0) {
+            hit -> len = len;
+            si -> hits[kept++] = *hit;
+        }
+    }
+    si -> num_hits = kept;
 }
 
-/*** Editor operations ***/
-
-void editorInsertChar(int c) {
-    // If this is true, the cursor is on the tilde line after the end of
-    // the file, so we need to append a new row to the file before inserting
-    // a character there.
-    if (ec.cursor_y == ec.num_rows)
-        editorInsertRow(ec.num_rows, "", 0);
-    editorRowInsertChar(&ec.row[ec.cursor_y], ec.cursor_x, c);
-    ec.cursor_x++; // This way we can see "how dirty" a file is.
+void searchIndexAdd(ssize_t y, ssize_t x, ssize_t len) {
+    struct search_index* si = &ec.search;
+    if (si -> num_hits == si -> cap) {
+        ssize_t cap = si -> cap ? si -> cap * 2 : 1024;
+        struct search_hit* hits = si -> num_hits < TTE_SEARCH_MAX_HITS ? realloc(si -> hits, sizeof(struct search_hit) * cap) : NULL;
+        if (hits == NULL) {
+            si -> full = 1;
+            return;
+        }
+        si -> hits = hits;
+        si -> cap = cap;
+    }
+    si -> hits[si -> num_hits].y = y;
+    si -> hits[si -> num_hits].x = x;
+    si -> hits[si -> num_hits].len = len;
+    si -> num_hits++;
 }
 
-void editorDelChar() {
-    // If the cursor is past the end of the file, there's nothing to delete.
-    if (ec.cursor_y == ec.num_rows)
-        return;
-    // Cursor is at the beginning of a file, there's nothing to delete.
-    if (ec.cursor_x == 0 && ec.cursor_y == 0)
+// Adds the matches in row y, the same way editorSearchCallback() finds
+// them.
+void searchIndexRow(struct search_matcher* m, ssize_t y, int has_space) {
+    editor_row* row = &ec.row[y];
+    const char* text = editorRowText(row);
+    ssize_t found;
+    ssize_t len;
+    if (has_space && !row -> chunks && memchr(text, '\t', row -> size)) {
+        if (editorRowThaw(row) == -1) {
+            editorMemoryFull();
+            return;
+        }
+        for (ssize_t rx = 0; !ec.search.full && (found = searchFind(m, row -> render + rx, row -> render_size - rx)) != -1; rx += found + 1)
+            searchIndexAdd(y, editorRowRenderXToCursorX(row, rx + found), m -> len);
         return;
-
-    editor_row* row = &ec.row[ec.cursor_y];
-    if (ec.cursor_x > 0) {
-        editorRowDelChar(row, ec.cursor_x - 1);
-        ec.cursor_x--;
-    // Deleting a line and moving up all the content.
-    } else {
-        ec.cursor_x = ec.row[ec.cursor_y - 1].size;
-        editorRowAppendString(&ec.row[ec.cursor_y -1], row -> chars, row -> size);
-        editorDelRow(ec.cursor_y);
-        ec.cursor_y--;
     }
+    for (ssize_t x = 0; !ec.search.full && (found = searchMatch(m, text, row -> size, x, &len)) != -1; x = searchNext(m, found, len))
+        searchIndexAdd(y, found, len);
 }
 
-/*** File I/O ***/
+// Rows of a slice that one thread looks at. Rows are only read, cold
+// ones through a view of the thread's own, and rows that would have to
+// be thawed are left to the main thread (as hits with x = -1).
+struct search_batch {
+    ssize_t from;
+    ssize_t to;
+    struct search_hit* hits;
+    ssize_t num_hits;
+    ssize_t cap;
+    int full; // 1 if it stopped before `to`, out of memory or hits.
+    int done; // 0 if it was canceled before `to`.
+};
 
-char* editorRowsToString(int* buf_len) {
-    int total_len = 0;
-    int j;
-    // Adding up the lengths of each row of text, adding 1
-    // to each one for the newline character we'll add to
-    // the end of each line.
-    for (j = 0; j < ec.num_rows; j++) {
-        total_len += ec.row[j].size + 1;
-    }
-    *buf_len = total_len;
+// The threads of a search, started with its first batches and stopped
+// when it's cleared. They take the batches of a slice one at a time and
+// wait between slices, so rows only change while nobody reads them.
+struct search_pool {
+    pthread_t threads[TTE_SEARCH_THREADS];
+    int num_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work; // There are batches to take, or the pool stops.
+    pthread_cond_t done; // A batch was finished.
+    struct search_matcher matcher;
+    int has_space;
+    int skip_short;
+    struct search_batch batches[TTE_SEARCH_THREADS * TTE_SEARCH_QUEUE];
+    int num_batches;
+    int next_batch;
+    int finished;
+    int slice; // Counts the slices, cold blocks may change between them.
+    int cancel; // Checked between rows, set when a key is typed.
+    int stop;
+};
 
-    char* buf = malloc(total_len);
-    char* p = buf;
-    // Copying the contents of each row to the end of the
-    // buffer, appending a newline character after each
-    // row.
-    for (j = 0; j < ec.num_rows; j++) {
-        memcpy(p, ec.row[j].chars, ec.row[j].size);
-        p += ec.row[j].size;
-        *p = '\n';
-        p++;
+int searchBatchAdd(struct search_batch* b, ssize_t y, ssize_t x, ssize_t len) {
+    if (b -> num_hits == b -> cap) {
+        ssize_t cap = b -> cap ? b -> cap * 2 : 256;
+        struct search_hit* hits = b -> num_hits < TTE_SEARCH_MAX_HITS ? realloc(b -> hits, sizeof(struct search_hit) * cap) : NULL;
+        if (hits == NULL) {
+            b -> full = 1;
+            return -1;
+        }
+        b -> hits = hits;
+        b -> cap = cap;
     }
-
-    return buf;
+    b -> hits[b -> num_hits].y = y;
+    b -> hits[b -> num_hits].x = x;
+    b -> hits[b -> num_hits].len = len;
+    b -> num_hits++;
+    return 0;
 }
 
-static int fileExists(const char* file_name) {
-    struct stat s = {0};
-    return stat(file_name, &s) == 0;
+void searchBatchRun(struct search_pool* pool, struct search_batch* b, struct search_matcher* m, struct cold_view* view) {
+    ssize_t y;
+    for (y = b -> from; y < b -> to && !b -> full; y++) {
+        if (__atomic_load_n(&pool -> cancel, __ATOMIC_RELAXED))
+            return;
+        if (pool -> skip_short && ec.meta.size[y] < (ssize_t) m -> len)
+            continue;
+        editor_row* row = &ec.row[y];
+        const char* text = row -> cold ? coldViewText(view, row) : row -> chars;
+        ssize_t found;
+        ssize_t len;
+        if (pool -> has_space && !row -> chunks && memchr(text, '\t', row -> size)) {
+            if (row -> cold) {
+                searchBatchAdd(b, y, -1, 0);
+                continue;
+            }
+            for (ssize_t rx = 0; (found = searchFind(m, row -> render + rx, row -> render_size - rx)) != -1; rx += found + 1) {
+                if (searchBatchAdd(b, y, editorRowRenderXToCursorX(row, rx + found), m -> len) == -1)
+                    break;
+            }
+            continue;
+        }
+        for (ssize_t x = 0; (found = searchMatch(m, text, row -> size, x, &len)) != -1; x = searchNext(m, found, len)) {
+            if (searchBatchAdd(b, y, found, len) == -1)
+                break;
+        }
+    }
+    b -> done = 1;
 }
 
-void editorOpen(char* file_name) {
-    free(ec.file_name);
-    ec.file_name = strdup(file_name);
-
-    editorSelectSyntaxHighlight();
-
-    // If the file dosen't exist, create it, otherwise just open it
-    const char *mode = fileExists(file_name) ? "r+" : "w+";
+void* searchPoolRun(void* arg) {
+    struct search_pool* pool = arg;
+    // A regex's DFA is built as it's used, each thread builds its own
+    // and keeps it for the whole search.
+    struct search_matcher matcher = pool -> matcher;
+    struct regex_dfa dfa = {NULL, NULL, 0, -1};
+    if (matcher.re)
+        matcher.dfa = &dfa;
+    struct cold_view view = {NULL, NULL, 0};
+    int slice = 0;
+    pthread_mutex_lock(&pool -> lock);
+    while (!pool -> stop) {
+        if (pool -> next_batch == pool -> num_batches) {
+            pthread_cond_wait(&pool -> work, &pool -> lock);
+            continue;
+        }
+        struct search_batch* b = &pool -> batches[pool -> next_batch++];
+        // Blocks may have been freed (and others made at the same
+        // address) since the last slice.
+        if (slice != pool -> slice)
+            view.cached = NULL;
+        slice = pool -> slice;
+        pthread_mutex_unlock(&pool -> lock);
+        searchBatchRun(pool, b, &matcher, &view);
+        pthread_mutex_lock(&pool -> lock);
+        pool -> finished++;
+        pthread_cond_signal(&pool -> done);
+    }
+    pthread_mutex_unlock(&pool -> lock);
+    regexDfaFree(&dfa);
+    free(view.raw);
+    return NULL;
+}
 
-    FILE* file = fopen(file_name, mode);
-    if (!file)
-        die("Failed to open the file");
+int searchThreads() {
+    static int threads = 0;
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus < 1 ? 1 : cpus > TTE_SEARCH_THREADS ? TTE_SEARCH_THREADS : cpus;
+    }
+    return threads;
+}
 
-    char* line = NULL;
-    // Unsigned int of at least 16 bit.
-    size_t line_cap = 0;
-    // Bigger than int
-    ssize_t line_len;
-    while ((line_len = getline(&line, &line_cap, file)) != -1) {
-        // We already know each row represents one line of text, there's no need
-        // to keep carriage return and newline characters.
-        if (line_len > 0 && (line[line_len - 1] == '\n' || line[line_len - 1] == '\r'))
-            line_len--;
-        editorInsertRow(ec.num_rows, line, line_len);
+// Starts the threads of the search. Returns -1 if none could be started.
+int searchPoolStart(struct search_matcher* m, int threads) {
+    struct search_pool* pool = malloc(sizeof(struct search_pool));
+    if (pool == NULL)
+        return -1;
+    memset(pool, 0, sizeof(*pool));
+    pool -> matcher = *m;
+    pthread_mutex_init(&pool -> lock, NULL);
+    pthread_cond_init(&pool -> work, NULL);
+    pthread_cond_init(&pool -> done, NULL);
+    while (pool -> num_threads < threads &&
+        pthread_create(&pool -> threads[pool -> num_threads], NULL, searchPoolRun, pool) == 0)
+        pool -> num_threads++;
+    ec.search.pool = pool;
+    if (pool -> num_threads == 0) {
+        searchPoolStop();
+        return -1;
     }
-    free(line);
-    fclose(file);
-    ec.dirty = 0;
+    return 0;
 }
 
-void editorSave() {
-    if (ec.file_name == NULL) {
-        ec.file_name = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-        if (ec.file_name == NULL) {
-            editorSetStatusMessage("Save aborted");
-            return;
+void searchPoolStop() {
+    struct search_pool* pool = ec.search.pool;
+    if (pool == NULL)
+        return;
+    pthread_mutex_lock(&pool -> lock);
+    pool -> stop = 1;
+    pthread_cond_broadcast(&pool -> work);
+    pthread_mutex_unlock(&pool -> lock);
+    for (int t = 0; t < pool -> num_threads; t++)
+        pthread_join(pool -> threads[t], NULL);
+    pthread_mutex_destroy(&pool -> lock);
+    pthread_cond_destroy(&pool -> work);
+    pthread_cond_destroy(&pool -> done);
+    free(pool);
+    ec.search.pool = NULL;
+}
+
+// Hands the next rows to the threads as a queue of batches, and adds what
+// they found in order. The main thread waits for them, so rows don't
+// change underneath, and the rows are sized to take about a slice. A key
+// typed meanwhile cancels the rest: the batches finished before the first
+// canceled one are kept, the others are looked at again next time.
+void searchIndexParallel(struct search_matcher* m, int has_space, int skip_short) {
+    struct search_index* si = &ec.search;
+    struct search_pool* pool = si -> pool;
+    if (si -> batch == 0)
+        si -> batch = TTE_SEARCH_BATCH;
+    ssize_t rows = si -> batch * pool -> num_threads;
+    if (rows > ec.num_rows - si -> next_y)
+        rows = ec.num_rows - si -> next_y;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_mutex_lock(&pool -> lock);
+    int num_batches = pool -> num_threads * TTE_SEARCH_QUEUE;
+    for (int k = 0; k < num_batches; k++) {
+        struct search_batch* b = &pool -> batches[k];
+        memset(b, 0, sizeof(*b));
+        b -> from = si -> next_y + rows * k / num_batches;
+        b -> to = si -> next_y + rows * (k + 1) / num_batches;
+    }
+    pool -> has_space = has_space;
+    pool -> skip_short = skip_short;
+    pool -> num_batches = num_batches;
+    pool -> next_batch = 0;
+    pool -> slice++;
+    pool -> finished = 0;
+    pool -> cancel = 0;
+    pthread_cond_broadcast(&pool -> work);
+    while (pool -> finished < num_batches) {
+        struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+        if (!pool -> cancel && poll(&pfd, 1, 0) != 0)
+            __atomic_store_n(&pool -> cancel, 1, __ATOMIC_RELAXED);
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += 1000000;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
         }
-        editorSelectSyntaxHighlight();
+        pthread_cond_timedwait(&pool -> done, &pool -> lock, &until);
+    }
+    pool -> num_batches = pool -> next_batch = 0;
+    pthread_mutex_unlock(&pool -> lock);
+
+    int canceled = 0;
+    for (int k = 0; k < num_batches; k++) {
+        struct search_batch* b = &pool -> batches[k];
+        canceled |= !b -> done;
+        for (ssize_t j = 0; j < b -> num_hits && !canceled && !si -> full; j++) {
+            if (b -> hits[j].x == -1)
+                searchIndexRow(m, b -> hits[j].y, has_space);
+            else
+                searchIndexAdd(b -> hits[j].y, b -> hits[j].x, b -> hits[j].len);
+        }
+        if (!canceled) {
+            if (b -> full)
+                si -> full = 1;
+            si -> next_y = b -> to;
+        }
+        free(b -> hits);
     }
+    if (canceled)
+        return;
 
-    int len;
-    char* buf = editorRowsToString(&len);
+    long ms = elapsedMs(&start);
+    if (ms < TTE_SEARCH_SLICE_MS / 2)
+        si -> batch *= 2;
+    else if (ms > TTE_SEARCH_SLICE_MS * 2 && si -> batch > 1024)
+        si -> batch /= 2;
+}
 
-    // We want to create if it doesn't already exist (O_CREAT flag), giving
-    // 0644 permissions (the standard ones). O_RDWR stands for reading and
-    // writing.
-    int fd = open(ec.file_name, O_RDWR | O_CREAT, 0644);
-    if (fd != -1) {
-        // ftruncate sets the file's size to the specified length.
-        if (ftruncate(fd, len) != -1) {
-            // Writing the file.
-            if (write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                ec.dirty = 0;
-                editorSetStatusMessage("%d bytes written to disk", len);
-                return;
-            }
+void editorSearchIndexSlice() {
+    struct search_index* si = &ec.search;
+    struct search_matcher matcher;
+    if (!si -> regex)
+        searchPrepare(&matcher, si -> query);
+    else if (searchPrepareRegex(&matcher, si -> query) == -1)
+        return;
+    int has_space = !si -> regex && strchr(si -> query, ' ') != NULL;
+    int skip_short = !has_space && editorMetaUpdate() == 0;
+    int threads = searchThreads();
+    if (threads > 1 && ec.num_rows - si -> next_y >= TTE_SEARCH_BATCH &&
+        (si -> pool || searchPoolStart(&matcher, threads) == 0)) {
+        searchIndexParallel(&matcher, has_space, skip_short);
+        if (si -> next_y >= ec.num_rows || si -> full) {
+            si -> done = 1;
+            searchPoolStop();
         }
-        close(fd);
+        return;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (si -> next_y < ec.num_rows && !si -> full) {
+        ssize_t y = si -> next_y++;
+        if (!skip_short || ec.meta.size[y] >= (ssize_t) matcher.len)
+            searchIndexRow(&matcher, y, has_space);
+        if (y % 1024 == 0 && elapsedMs(&start) >= TTE_SEARCH_SLICE_MS)
+            break;
     }
+    if (si -> next_y >= ec.num_rows || si -> full)
+        si -> done = 1;
+}
 
-    free(buf);
-    editorSetStatusMessage("Cant's save file. Error occurred: %s", strerror(errno));
+// Index of the first match at or after (y, x).
+ssize_t searchIndexFind(ssize_t y, ssize_t x) {
+    struct search_index* si = &ec.search;
+    ssize_t lo = 0;
+    ssize_t hi = si -> num_hits;
+    while (lo < hi) {
+        ssize_t mid = lo + (hi - lo) / 2;
+        struct search_hit* hit = &si -> hits[mid];
+        if (hit -> y < y || (hit -> y == y && hit -> x < x))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
 }
 
-/*** Search section ***/
+// Index of the match the cursor is on, -1 if it's not known (yet).
+ssize_t searchIndexCurrent() {
+    struct search_index* si = &ec.search;
+    if (si -> query == NULL || si -> match_y == -1)
+        return -1;
+    ssize_t k = searchIndexFind(si -> match_y, si -> match_x);
+    if (k == si -> num_hits || si -> hits[k].y != si -> match_y || si -> hits[k].x != si -> match_x)
+        return -1;
+    return k;
+}
+
+// The search prompt, it tells whether a regex is typed. It's the same
+// buffer every time, so editorPrompt() shows it changed as it's redone.
+char* editorSearchPrompt() {
+    static char prompt[64];
+    snprintf(prompt, sizeof(prompt), "%s: %%s (Use ESC / Enter / Arrows, Ctrl-R: %s)",
+        ec.search.regex ? "Regex search" : "Search", ec.search.regex ? "text" : "regex");
+    return prompt;
+}
 
 void editorSearchCallback(char* query, int key) {
     // Index of the row that the last match was on, -1 if there was
     // no last match.
-    static int last_match = -1;
+    static ssize_t last_match = -1;
     // 1 for searching forward and -1 for searching backwards.
     static int direction = 1;
 
-    static int saved_highlight_line;
+    static ssize_t saved_highlight_line;
     static char* saved_hightlight = NULL;
 
-    if (saved_hightlight) {
+    static struct search_typed typed = {NULL, NULL, 0};
+    int typing = 0;
+    // Line to start from when the query narrows, -2 if there's none.
+    ssize_t from = -2;
+
+    if (saved_hightlight && ec.row[saved_highlight_line].highlight) {
         memcpy(ec.row[saved_highlight_line].highlight, saved_hightlight, ec.row[saved_highlight_line].render_size);
         free(saved_hightlight);
         saved_hightlight = NULL;
@@ -1223,6 +5524,8 @@ void editorSearchCallback(char* query, int key) {
     if (key == '\r' || key == '\x1b') {
         last_match = -1;
         direction = 1;
+        searchTypedClear(&typed);
+        searchIndexClear();
         return;
     } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
         direction = 1;
@@ -1233,55 +5536,154 @@ void editorSearchCallback(char* query, int key) {
         }
         direction = -1;
     } else {
+        // Ctrl-R switches between a query and a regex, what's typed is
+        // looked for again. A regex can't be narrowed like a query.
+        if (key == CTRL_KEY('r')) {
+            ec.search.regex = !ec.search.regex;
+            editorSearchPrompt();
+            searchTypedClear(&typed);
+        }
         last_match = -1;
         direction = 1;
+        typing = 1;
+        from = ec.search.regex ? -2 : searchTypedFrom(&typed, query);
+        searchIndexStart(query, from == -1);
+        if (from == -1) {
+            searchTypedSet(&typed, query, -1);
+            return;
+        }
+    }
+
+    // The match found, in chars and on screen (-2 if not known yet).
+    ssize_t match_y = -1;
+    ssize_t match_x = -1;
+    ssize_t match_len = 0;
+    ssize_t render_x = -2;
+
+    // Once the index has the next match, it's a jump there. It wraps
+    // around only when it has all of them.
+    ssize_t k = typing ? -1 : searchIndexCurrent();
+    struct search_index* si = &ec.search;
+    if (k != -1) {
+        k += direction;
+        if ((k < 0 || k >= si -> num_hits) && si -> done && !si -> full)
+            k = (k + si -> num_hits) % si -> num_hits;
+        if (k >= 0 && k < si -> num_hits) {
+            match_y = si -> hits[k].y;
+            match_x = si -> hits[k].x;
+            match_len = si -> hits[k].len;
+        }
+    }
+
+    // The paged viewer looks for the line in the file and moves the
+    // window there, then it's found in the rows like usual.
+    if (ec.read_only) {
+        ssize_t line = editorPagerFind(query, from >= 0 ? from : last_match == -1 ? 0 : ec.row_base + last_match + direction, direction);
+        if (line == -1) {
+            if (typing)
+                searchTypedSet(&typed, query, -1);
+            return;
+        }
+        ssize_t first_line = line - TTE_PAGER_WINDOW_PAGES * ec.screen_rows / 2;
+        editorPagerLoad(first_line < 0 ? 0 : first_line);
+        last_match = line - ec.row_base - direction;
+        from = -2;
     }
 
-    int current = last_match;
-    int i;
-    for (i = 0; i < ec.num_rows; i++) {
+    // Rows shorter than the query (or a regex's literal) can't have it,
+    // that's told from their metadata alone. Unless it has spaces, a tab
+    // may render as them.
+    struct search_matcher matcher;
+    if (!ec.search.regex)
+        searchPrepare(&matcher, query);
+    else if (searchPrepareRegex(&matcher, query) == -1)
+        return;
+    ssize_t query_len = matcher.len;
+    int has_space = !ec.search.regex && strchr(query, ' ') != NULL;
+    int skip_short = !has_space && editorMetaUpdate() == 0;
+    ssize_t current = from >= 0 ? from - ec.row_base - 1 : last_match;
+    ssize_t i;
+    for (i = 0; match_y == -1 && i < ec.num_rows; i++) {
         current += direction;
         if (current == -1)
             current = ec.num_rows - 1;
         else if (current == ec.num_rows)
             current = 0;
 
+        if (skip_short && ec.meta.size[current] < query_len)
+            continue;
         editor_row* row = &ec.row[current];
-        // We use strstr to check if query is a substring of the
-        // current row. It returns NULL if there is no match,
-        // oterwhise it returns a pointer to the matching substring.
-        char* match = strstr(row -> render, query);
-        if (match) {
-            last_match = current;
-            ec.cursor_y = current;
-            ec.cursor_x = editorRowRenderXToCursorX(row, match - row -> render);
-            // We set this like so to scroll to the bottom of the file so
-            // that the next screen refresh will cause the matching line to
-            // be at the very top of the screen.
-            ec.row_offset = ec.num_rows;
-
-            saved_highlight_line = current;
-            saved_hightlight = malloc(row -> render_size);
-            memcpy(saved_hightlight, row -> highlight, row -> render_size);
-            memset(&row -> highlight[match - row -> render], HL_MATCH, strlen(query));
-            break;
+        // Rows are searched as they are (cold ones without thawing them)
+        // and the match is mapped to its column. Tabs render as spaces,
+        // so a query with spaces is looked for in the render of rows with
+        // tabs.
+        const char* text = editorRowText(row);
+        int in_render = has_space && !row -> chunks && memchr(text, '\t', row -> size);
+        ssize_t x = -1;
+        if (!in_render && (x = searchMatch(&matcher, text, row -> size, 0, &match_len)) == -1)
+            continue;
+        if (in_render) {
+            if (editorRowThaw(row) == -1 || (render_x = searchFind(&matcher, row -> render, row -> render_size)) == -1)
+                continue;
+            x = editorRowRenderXToCursorX(row, render_x);
+            match_len = query_len;
         }
+        match_y = current;
+        match_x = x;
+    }
+    if (match_y == -1) {
+        if (typing)
+            searchTypedSet(&typed, query, -1);
+        return;
+    }
+
+    editor_row* row = &ec.row[match_y];
+    // Long rows have no render, they are not highlighted.
+    if (editorRowThaw(row) == -1 || row -> chunks)
+        render_x = -1;
+    else if (render_x == -2)
+        render_x = editorRowCursorXToRenderX(row, match_x);
+    last_match = match_y;
+    si -> match_y = match_y;
+    si -> match_x = match_x;
+    ec.cursor_y = match_y;
+    ec.cursor_x = match_x;
+    // We set this like so to scroll to the bottom of the file so
+    // that the next screen refresh will cause the matching line to
+    // be at the very top of the screen.
+    ec.row_offset = ec.num_rows;
+
+    if (render_x != -1 && row -> highlight) {
+        saved_highlight_line = match_y;
+        saved_hightlight = malloc(row -> render_size);
+        memcpy(saved_hightlight, row -> highlight, row -> render_size);
+        // A regex match may have tabs, so it's measured on screen.
+        ssize_t render_len = ec.search.regex ? editorRowCursorXToRenderX(row, match_x + match_len) - render_x : query_len;
+        memset(&row -> highlight[render_x], HL_MATCH, render_len);
     }
+    if (typing)
+        searchTypedSet(&typed, query, ec.row_base + match_y);
 }
 
 void editorSearch() {
-    int saved_cursor_x = ec.cursor_x;
-    int saved_cursor_y = ec.cursor_y;
-    int saved_col_offset = ec.col_offset;
-    int saved_row_offset = ec.row_offset;
+    // Matches can be anywhere, so the whole file is needed.
+    editorLoadUntil(SSIZE_MAX);
+
+    ssize_t saved_row_base = ec.row_base;
+    ssize_t saved_cursor_x = ec.cursor_x;
+    ssize_t saved_cursor_y = ec.cursor_y;
+    ssize_t saved_col_offset = ec.col_offset;
+    ssize_t saved_row_offset = ec.row_offset;
 
-    char* query = editorPrompt("Search: %s (Use ESC / Enter / Arrows)", editorSearchCallback);
+    char* query = editorPrompt(editorSearchPrompt(), editorSearchCallback);
 
     if (query) {
         free(query);
     // If query is NULL, that means they pressed Escape, so in that case we
     // restore the cursor previous position.
     } else {
+        if (ec.read_only && ec.row_base != saved_row_base)
+            editorPagerLoad(saved_row_base);
         ec.cursor_x = saved_cursor_x;
         ec.cursor_y = saved_cursor_y;
         ec.col_offset = saved_col_offset;
@@ -1289,13 +5691,46 @@ void editorSearch() {
     }
 }
 
+// Moves the cursor to a byte offset of the file, or to a percentage of
+// it when the number ends with '%'.
+void editorGoToOffset() {
+    editorLoadUntil(SSIZE_MAX);
+    char* target = editorPrompt("Go to byte offset (or N%%): %s (ESC to cancel)", NULL);
+    if (target == NULL)
+        return;
+    char* end;
+    long long value = strtoll(target, &end, 10);
+    int percent = *end == '%';
+    free(target);
+    ssize_t total = editorRowOffset(ec.num_rows);
+    if (total == -1) {
+        editorSetStatusMessage("Can't go there, out of memory");
+        return;
+    }
+    ssize_t offset = percent ? (ssize_t) ((double) total * value / 100) : (ssize_t) value;
+    if (offset < 0)
+        offset = 0;
+    if (offset >= total)
+        offset = total > 0 ? total - 1 : 0;
+    ssize_t y = editorRowAtOffset(offset);
+    if (y >= ec.num_rows) {
+        ec.cursor_y = ec.num_rows;
+        ec.cursor_x = 0;
+        return;
+    }
+    ec.cursor_y = y;
+    ec.cursor_x = offset - editorRowOffset(y);
+    if (ec.cursor_x > ec.row[y].size)
+        ec.cursor_x = ec.row[y].size;
+}
+
 /*** Action section ***/
 
 typedef struct Action Action;
 struct Action {
     ActionType t;
-    int cpos_x;
-    int cpos_y;
+    ssize_t cpos_x;
+    ssize_t cpos_y;
     bool cursor_on_tilde;
     char* string;
 };
@@ -1507,6 +5942,72 @@ void freeAlist() {
     }
 }
 
+// Drops the oldest undo actions until there are no more than `keep`.
+void trimActions(int keep) {
+    ActionList* list = ec.actions;
+    if(!list) return;
+    while(list->size > keep && list->head && list->head != list->current) {
+        AListNode* node = list->head;
+        list->head = node->next;
+        if(list->head) list->head->prev = NULL;
+        else list->tail = NULL;
+        freeAction(node->action);
+        free(node);
+        list->size--;
+    }
+}
+
+// Moves an action to where its rows are after a reload. It can only be
+// kept if the rows around it weren't changed.
+bool remapAction(Action* action, ssize_t* old_to_new, ssize_t old_num_rows) {
+    ssize_t y = action->cpos_y;
+    if (y < 0 || y > old_num_rows || old_to_new[y] == -1)
+        return false;
+    ssize_t shift = old_to_new[y] - y;
+    for (ssize_t k = y - 1; k <= y + 1; k++) {
+        if (k < 0 || k > old_num_rows)
+            continue;
+        if (old_to_new[k] == -1 || old_to_new[k] - k != shift)
+            return false;
+    }
+    action->cpos_y += shift;
+    return true;
+}
+
+// Called after the file was reloaded. Actions touching changed rows can't
+// be replayed anymore, and neither can the ones depending on them: older
+// undo actions and newer redo actions are dropped too.
+void remapActions(ssize_t* old_to_new, ssize_t old_num_rows) {
+    ActionList* list = ec.actions;
+    if(!list) return;
+
+    AListNode* last_bad_undo = NULL;
+    AListNode* first_bad_redo = NULL;
+    bool redo_side = list->current == NULL;
+    for(AListNode* node = list->head; node; node = node->next) {
+        if(!remapAction(node->action, old_to_new, old_num_rows)) {
+            if(!redo_side) last_bad_undo = node;
+            else if(!first_bad_redo) first_bad_redo = node;
+        }
+        if(node == list->current) redo_side = true;
+    }
+
+    if(first_bad_redo) {
+        list->tail = first_bad_redo->prev;
+        list->size -= clearAlistFrom(first_bad_redo);
+        if(list->tail == NULL) list->head = NULL;
+    }
+    if(last_bad_undo) {
+        if(list->current == last_bad_undo) list->current = NULL;
+        AListNode* keep = last_bad_undo->next;
+        last_bad_undo->next = NULL;
+        if(keep) keep->prev = NULL;
+        list->size -= clearAlistFrom(list->head);
+        list->head = keep;
+        if(keep == NULL) list->tail = list->current = NULL;
+    }
+}
+
 void addAction(Action* action) {
     if(ACTIONS_LIST_MAX_SIZE == 0) return;
     ActionList* list = ec.actions;
@@ -1563,7 +6064,7 @@ bool concatWithLastAction(ActionType t, char* str) {
        ec.actions->current == ec.actions->tail &&
        ec.actions->current->action->t == t &&
        ec.actions->current->action->cpos_y == ec.cursor_y &&
-       (int)(ec.actions->current->action->cpos_x + strlen(ec.actions->current->action->string)) == ec.cursor_x
+       (ssize_t)(ec.actions->current->action->cpos_x + strlen(ec.actions->current->action->string)) == ec.cursor_x
     ) {
         int c = *(str);
         editorInsertChar(c);
@@ -1616,7 +6117,7 @@ void redo() {
 
 /*** Append buffer section **/
 
-void abufAppend(struct a_buf* ab, const char* s, int len) {
+void abufAppend(struct a_buf* ab, const char* s, ssize_t len) {
     // Using realloc to get a block of free memory that is
     // the size of the current string + the size of the string
     // to be appended.
@@ -1640,8 +6141,14 @@ void abufFree(struct a_buf* ab) {
 /*** Output section ***/
 
 void editorScroll() {
+    if (ec.read_only)
+        editorPagerSync();
+    // There must be rows for the whole screen, and the cursor can't go
+    // past the end of what's loaded.
+    editorLoadUntil((ec.cursor_y > ec.row_offset ? ec.cursor_y : ec.row_offset) + ec.screen_rows + 1);
+
     ec.render_x = 0;
-    if (ec.cursor_y < ec.num_rows)
+    if (ec.cursor_y < ec.num_rows && editorRowThaw(&ec.row[ec.cursor_y]) == 0)
         ec.render_x = editorRowCursorXToRenderX(&ec.row[ec.cursor_y], ec.cursor_x);
     // The first if statement checks if the cursor is above the visible window,
     // and if so, scrolls up to where the cursor is. The second if statement checks
@@ -1653,6 +6160,7 @@ void editorScroll() {
         ec.row_offset = ec.cursor_y;
     if (ec.cursor_y >= ec.row_offset + ec.screen_rows)
         ec.row_offset = ec.cursor_y - ec.screen_rows + 1;
+    editorThawRows(ec.row_offset, ec.row_offset + ec.screen_rows);
 
     if (ec.render_x < ec.col_offset)
         ec.col_offset = ec.render_x;
@@ -1672,9 +6180,48 @@ void editorDrawStatusBar(struct a_buf* ab) {
 
     char status[80], r_status[80];
     // Showing up to 20 characters of the filename, followed by the number of lines.
-    int len = snprintf(status, sizeof(status), " Editing: %.20s %s", ec.file_name ? ec.file_name : "New file", ec.dirty ? "(modified)" : "");
-    int col_size = ec.row && ec.cursor_y <= ec.num_rows - 1 ? col_size = ec.row[ec.cursor_y].size : 0;
-    int r_len = snprintf(r_status, sizeof(r_status), "%d/%d lines  %d/%d cols ", ec.cursor_y + 1 > ec.num_rows ? ec.num_rows : ec.cursor_y + 1, ec.num_rows,
+    int len = snprintf(status, sizeof(status), " %s: %.20s %s", ec.read_only ? "Viewing" : "Editing",
+        ec.file_name ? ec.file_name : "New file", ec.dirty ? "(modified)" : "");
+    if (ec.loader && ec.loader -> size > 0) {
+        off_t percent = ec.loader -> offset * 100 / ec.loader -> size;
+        len += snprintf(&status[len], sizeof(status) - len, " (loading %d%%)", (int) (percent > 99 ? 99 : percent));
+    }
+    // While searching, how many matches there are (so far).
+    if (ec.search.bad) {
+        len += snprintf(&status[len], sizeof(status) - len, " (bad regex)");
+    } else if (ec.search.query) {
+        ssize_t k = searchIndexCurrent();
+        const char* more = ec.search.done && !ec.search.full ? "" : "+";
+        if (k != -1)
+            len += snprintf(&status[len], sizeof(status) - len, " (match %zd of %zd%s)", k + 1, ec.search.num_hits, more);
+        else
+            len += snprintf(&status[len], sizeof(status) - len, " (%zd%s matches)", ec.search.num_hits, more);
+    }
+    ssize_t col_size = ec.row && ec.cursor_y <= ec.num_rows - 1 ? col_size = ec.row[ec.cursor_y].size : 0;
+    // The paged viewer doesn't know how many lines there are until it
+    // reaches the end of the file.
+    char total[24];
+    ssize_t total_lines = ec.read_only ? ec.pager.total_lines : ec.row_base + ec.num_rows;
+    if (total_lines == -1)
+        snprintf(total, sizeof(total), "?");
+    else
+        snprintf(total, sizeof(total), "%zd", total_lines);
+    // Same with +G until the lines before the first row are loaded.
+    char line[24];
+    if (ec.row_base == -1) {
+        snprintf(total, sizeof(total), "?");
+        snprintf(line, sizeof(line), "?");
+    } else
+        snprintf(line, sizeof(line), "%zd", ec.row_base + (ec.cursor_y + 1 > ec.num_rows ? ec.num_rows : ec.cursor_y + 1));
+    // How far through the file the cursor is, once all of it is loaded.
+    char through[16] = "";
+    ssize_t file_size = !ec.read_only && !ec.loader && ec.row_base == 0 ? editorRowOffset(ec.num_rows) : -1;
+    if (file_size > 0) {
+        ssize_t y = ec.cursor_y > ec.num_rows ? ec.num_rows : ec.cursor_y;
+        ssize_t offset = editorRowOffset(y) + (y < ec.num_rows ? (ec.cursor_x > col_size ? col_size : ec.cursor_x) : 0);
+        snprintf(through, sizeof(through), "%d%%  ", (int) (offset * 100 / file_size));
+    }
+    int r_len = snprintf(r_status, sizeof(r_status), "%s%s/%s lines  %zd/%zd cols ", through, line, total,
         ec.cursor_x + 1 > col_size ? col_size : ec.cursor_x + 1, col_size);
     if (len > ec.screen_cols)
         len = ec.screen_cols;
@@ -1747,16 +6294,18 @@ void editorSetStatusMessage(const char* msg, ...) {
 }
 
 void editorDrawRows(struct a_buf* ab) {
+    char* slice = malloc(ec.screen_cols);
+    unsigned char* slice_highlight = malloc(ec.screen_cols);
     int y;
     for (y = 0; y < ec.screen_rows; y++) {
-        int file_row = y + ec.row_offset;
+        ssize_t file_row = y + ec.row_offset;
         if(file_row >= ec.num_rows) {
             if (ec.num_rows == 0 && y == ec.screen_rows / 3)
                 editorDrawWelcomeMessage(ab);
             else
                 abufAppend(ab, "~", 1);
         } else {
-            int len = ec.row[file_row].render_size - ec.col_offset;
+            ssize_t len = ec.row[file_row].render_size - ec.col_offset;
             // len can be a negative number, meaning the user scrolled
             // horizontally past the end of the line. In that case, we set
             // len to 0 so that nothing is displayed on that line.
@@ -1765,10 +6314,41 @@ void editorDrawRows(struct a_buf* ab) {
             if (len > ec.screen_cols)
                 len = ec.screen_cols;
 
-            char* c = &ec.row[file_row].render[ec.col_offset];
-            unsigned char* highlight = &ec.row[file_row].highlight[ec.col_offset];
+            char* c;
+            unsigned char* highlight = slice_highlight;
+            if (ec.row[file_row].chunks) {
+                // Long rows are rendered only where they are seen.
+                c = slice;
+                len = editorRowRenderSlice(&ec.row[file_row], ec.col_offset, ec.screen_cols, slice);
+            } else {
+                // Without memory for it, a row has no render and is empty.
+                c = ec.row[file_row].render ? &ec.row[file_row].render[ec.col_offset] : slice;
+                if (ec.row[file_row].highlight)
+                    highlight = &ec.row[file_row].highlight[ec.col_offset];
+            }
+            // Long rows have no syntax highlighting, nor have rows there
+            // was no memory for it. Only their matches are shown.
+            if (highlight == slice_highlight)
+                memset(slice_highlight, HL_NORMAL, ec.screen_cols);
+            // All matches of a search on screen are highlighted.
+            ssize_t k = ec.search.query ? searchIndexFind(file_row, 0) : 0;
+            if (k < ec.search.num_hits && ec.search.hits[k].y == file_row) {
+                if (highlight != slice_highlight)
+                    memcpy(slice_highlight, highlight, len);
+                for (; k < ec.search.num_hits && ec.search.hits[k].y == file_row; k++) {
+                    struct search_hit* hit = &ec.search.hits[k];
+                    ssize_t from = editorRowCursorXToRenderX(&ec.row[file_row], hit -> x) - ec.col_offset;
+                    // The hits of a row are in order, the rest are past the screen.
+                    if (from >= len)
+                        break;
+                    ssize_t to = ec.search.regex ? editorRowCursorXToRenderX(&ec.row[file_row], hit -> x + hit -> len) - ec.col_offset : from + hit -> len;
+                    for (ssize_t j = from < 0 ? 0 : from; j < to && j < len; j++)
+                        slice_highlight[j] = HL_MATCH;
+                }
+                highlight = slice_highlight;
+            }
             int current_color = -1;
-            int j;
+            ssize_t j;
             for (j = 0; j < len; j++) {
                 // Displaying nonprintable characters as (A-Z, @, and ?).
                 if (iscntrl(c[j])) {
@@ -1809,6 +6389,8 @@ void editorDrawRows(struct a_buf* ab) {
         // Addind a new line
         abufAppend(ab, "\r\n", 2);
     }
+    free(slice_highlight);
+    free(slice);
 }
 
 void editorRefreshScreen() {
@@ -1828,7 +6410,7 @@ void editorRefreshScreen() {
 
     // Moving the cursor where it should be.
     char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (ec.cursor_y - ec.row_offset) + 1, (ec.render_x - ec.col_offset) + 1);
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (int) (ec.cursor_y - ec.row_offset) + 1, (int) (ec.render_x - ec.col_offset) + 1);
     abufAppend(&ab, buf, strlen(buf));
 
     // Showing again the cursor.
@@ -1862,6 +6444,7 @@ char* editorPrompt(char* prompt, void (*callback)(char*, int)) {
     size_t buf_len = 0;
     buf[0] = '\0';
 
+    ec.in_prompt = 1;
     while (1) {
         editorSetStatusMessage(prompt, buf);
         editorRefreshScreen();
@@ -1875,12 +6458,14 @@ char* editorPrompt(char* prompt, void (*callback)(char*, int)) {
             if (callback)
                 callback(buf, c);
             free(buf);
+            ec.in_prompt = 0;
             return NULL;
         } else if (c == '\r') {
             if (buf_len != 0) {
                 editorSetStatusMessage("");
                 if (callback)
                     callback(buf, c);
+                ec.in_prompt = 0;
                 return buf;
             }
         } else if (!iscntrl(c) && isprint(c)) {
@@ -1900,6 +6485,12 @@ char* editorPrompt(char* prompt, void (*callback)(char*, int)) {
 void editorMoveCursor(int key) {
     editor_row* row = (ec.cursor_y >= ec.num_rows) ? NULL : &ec.row[ec.cursor_y];
 
+    // With +G the lines before the first row may not be loaded yet.
+    if (ec.loader && ec.loader -> end != -1 && ec.cursor_y == 0 && (key == ARROW_UP || (key == ARROW_LEFT && ec.cursor_x == 0))) {
+        editorLoadUntil(SSIZE_MAX);
+        row = (ec.cursor_y >= ec.num_rows) ? NULL : &ec.row[ec.cursor_y];
+    }
+
     switch (key) {
         case ARROW_LEFT:
             if (ec.cursor_x != 0)
@@ -1911,6 +6502,7 @@ void editorMoveCursor(int key) {
             }
             break;
         case ARROW_RIGHT:
+            editorLoadUntil(ec.cursor_y + 2);
             if (row && ec.cursor_x < row -> size)
                 ec.cursor_x++;
             // If -> is pressed, move to the start of the next line
@@ -1924,6 +6516,7 @@ void editorMoveCursor(int key) {
                 ec.cursor_y--;
             break;
         case ARROW_DOWN:
+            editorLoadUntil(ec.cursor_y + 2);
             if (ec.cursor_y < ec.num_rows)
                 ec.cursor_y++;
             break;
@@ -1931,7 +6524,7 @@ void editorMoveCursor(int key) {
 
     // Move cursor_x if it ends up past the end of the line it's on
     row = (ec.cursor_y >= ec.num_rows) ? NULL : &ec.row[ec.cursor_y];
-    int row_len = row ? row -> size : 0;
+    ssize_t row_len = row ? row -> size : 0;
     if (ec.cursor_x > row_len)
         ec.cursor_x = row_len;
 }
@@ -1941,6 +6534,22 @@ void editorProcessKeypress() {
 
     int c = editorReadKey();
 
+    // The paged viewer (-R) is read-only, so only moving around, searching,
+    // copying and quitting are allowed there.
+    if (ec.read_only && !(c == CTRL_KEY('q') || c == CTRL_KEY('f') || c == CTRL_KEY('c') ||
+        c == CTRL_KEY('p') || c == CTRL_KEY('l') || c == '\x1b' || (c >= ARROW_LEFT && c <= END_KEY))) {
+        editorSetStatusMessage("Read-only mode");
+        return;
+    }
+    // Over --max-memory, nothing that makes the file bigger is allowed.
+    if (ec.memory_full && !(c == CTRL_KEY('q') || c == CTRL_KEY('s') || c == CTRL_KEY('f') ||
+        c == CTRL_KEY('c') || c == CTRL_KEY('x') || c == CTRL_KEY('z') || c == CTRL_KEY('e') ||
+        c == CTRL_KEY('d') || c == CTRL_KEY('p') || c == CTRL_KEY('l') || c == CTRL_KEY('h') || c == CTRL_KEY('g') ||
+        c == '\x1b' || c == BACKSPACE || (c >= ARROW_LEFT && c <= DEL_KEY))) {
+        editorMemoryFull();
+        return;
+    }
+
     switch (c) {
         case '\r': // Enter key
             makeAction(NewLine, NULL);
@@ -1951,6 +6560,7 @@ void editorProcessKeypress() {
                 quit_times--;
                 return;
             }
+            editorCacheStore();
             editorClearScreen();
             freeAlist();
             consoleBufferClose();
@@ -2023,6 +6633,9 @@ void editorProcessKeypress() {
         case CTRL_KEY('f'):
             editorSearch();
             break;
+        case CTRL_KEY('g'):
+            editorGoToOffset();
+            break;
         case BACKSPACE:
         case CTRL_KEY('h'):
         case DEL_KEY:
@@ -2031,7 +6644,7 @@ void editorProcessKeypress() {
                 if (c == DEL_KEY)
                     editorMoveCursor(ARROW_RIGHT);
                 editor_row* row = &ec.row[ec.cursor_y];
-                char* string = ec.cursor_x > 0 ? strndup(&row->chars[ec.cursor_x-1], 1) : NULL;
+                char* string = ec.cursor_x > 0 ? strndup(&editorRowText(row)[ec.cursor_x-1], 1) : NULL;
                 makeAction(DelChar, string);
             }
             break;
@@ -2062,6 +6675,169 @@ void editorProcessKeypress() {
     quit_times = TTE_QUIT_TIMES;
 }
 
+/*** Memory limit section ***/
+
+// What tte holds for the file: rows and their buffers, cold blocks,
+// interned lines and the matches of a search. The undo actions aren't
+// counted, there are at most ACTIONS_LIST_MAX_SIZE of them.
+ssize_t editorMemoryUsed() {
+    return ec.slabs.live + ec.slabs.big_bytes + ec.cold.bytes +
+        ec.search.cap * (ssize_t) sizeof(struct search_hit) +
+        ec.row_cap * (ssize_t) sizeof(editor_row) +
+        ec.meta.cap * (ssize_t) (sizeof(ssize_t) + 1 + sizeof(uint32_t)) +
+        ec.meta.bytes_cap * (ssize_t) sizeof(ssize_t) +
+        ec.slabs.lines_cap * (ssize_t) sizeof(struct interned_line);
+}
+
+void editorMemoryFull() {
+    ec.memory_full = 1;
+    editorSetStatusMessage("Out of memory (--max-memory), edits that take more are refused");
+}
+
+// Gives up the rows and goes on viewing the file with the paged viewer,
+// around the same line.
+void editorMemoryPager() {
+    ssize_t line = ec.row_base + ec.cursor_y;
+    // While +G loads the lines before the last screen their number isn't
+    // known, the cursor is found counting from the end of the file.
+    ssize_t from_end = ec.row_base == -1 ? ec.num_rows - ec.cursor_y : -1;
+    if (ec.loader) {
+        editor_loader* ld = ec.loader;
+        for (ssize_t y = 0; y < ld -> num_rows; y++)
+            editorFreeRow(&ld -> rows[y]);
+        free(ld -> rows);
+        free(ld -> carry);
+        readerClose(&ld -> reader);
+        close(ld -> fd);
+        free(ld);
+        ec.loader = NULL;
+    }
+    for (ssize_t y = 0; y < ec.num_rows; y++)
+        editorFreeRow(&ec.row[y]);
+    free(ec.row);
+    ec.row = NULL;
+    ec.num_rows = ec.row_cap = 0;
+    editorMetaInvalidate(0);
+    rowFreeAll();
+    free(ec.cold.view.raw);
+    ec.cold.view.raw = NULL;
+    ec.cold.view.raw_cap = 0;
+    trimActions(0);
+    ec.row_base = 0;
+    ec.cursor_x = ec.cursor_y = ec.row_offset = ec.col_offset = 0;
+    ec.memory_full = 0;
+    ec.read_only = 1;
+
+    char* file_name = strdup(ec.file_name);
+    editorPagerOpen(file_name);
+    free(file_name);
+    if (from_end != -1) {
+        editorPagerIndexTo(SSIZE_MAX);
+        line = ec.pager.total_lines - from_end;
+    }
+    ssize_t first_line = line - ec.screen_rows / 2;
+    editorPagerLoad(first_line < 0 ? 0 : first_line);
+    ec.cursor_y = line - ec.row_base;
+    if (ec.cursor_y < 0 || ec.cursor_y >= ec.num_rows)
+        ec.cursor_y = 0;
+    ec.row_offset = ec.num_rows;
+    editorSetStatusMessage("Over --max-memory, viewing the file read-only");
+}
+
+// Close to --max-memory, what can be made again is given back first: rows
+// far from the screen lose their render and highlight (they are
+// compressed, whatever the budget) and only the newest undo actions are
+// kept. Over it, an unchanged file is viewed with the paged viewer
+// instead, a changed one stops taking edits that need memory.
+void editorMemoryCheck() {
+    if (ec.max_memory == 0 || ec.read_only)
+        return;
+    ssize_t used = editorMemoryUsed();
+    if (used < ec.max_memory / 4 * 3) {
+        ec.memory_full = 0;
+        ec.cold.budget = ec.max_memory / 2;
+        return;
+    }
+    ec.cold.budget = 0;
+    editorColdSweep();
+    trimActions(ACTIONS_LIST_MAX_SIZE / 8);
+    if (editorMemoryUsed() < ec.max_memory && !ec.memory_full)
+        return;
+    if (!ec.dirty && ec.file_name)
+        editorMemoryPager();
+    else if (!ec.memory_full)
+        editorMemoryFull();
+}
+
+/*** Idle section ***/
+
+// Edits leave rows spread over the arenas, in blocks bigger than they
+// need. While nothing is typed, the rows around the screen are moved, a
+// few at a time and in file order, into blocks that follow each other.
+// Rows already in place are left alone, so a pass over rows nobody
+// touched moves nothing.
+void editorCompact() {
+    struct row_slabs* sl = &ec.slabs;
+    if (sl -> compact_offset != ec.row_offset || sl -> compact_dirty != ec.dirty) {
+        sl -> compact_offset = ec.row_offset;
+        sl -> compact_dirty = ec.dirty;
+        sl -> compact_y = ec.row_offset > TTE_COMPACT_ROWS ? ec.row_offset - TTE_COMPACT_ROWS : 0;
+        sl -> compact_end = ec.row_offset + ec.screen_rows + TTE_COMPACT_ROWS;
+        memset(sl -> placed, 0, sizeof(sl -> placed));
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (sl -> compact_y < sl -> compact_end && sl -> compact_y < ec.num_rows) {
+        editorRowCompact(&ec.row[sl -> compact_y++]);
+        if (sl -> compact_y % 256 == 0 && elapsedMs(&start) >= TTE_COMPACT_SLICE_MS)
+            return;
+    }
+    // Once the pass is over, arenas it (or deleted rows) left empty go.
+    slabRelease();
+}
+
+// Once row buffers take more than the budget, rows far from the screen
+// are compressed, a block at a time. Freed blocks are taken again by the
+// rows loaded or thawed next, so memory stays around the budget.
+void editorColdSweep() {
+    struct editor_cold* cd = &ec.cold;
+    if (ec.read_only || ec.slabs.live <= cd -> budget)
+        return;
+    ssize_t near_from = ec.row_offset - TTE_COLD_DISTANCE;
+    ssize_t near_to = ec.row_offset + ec.screen_rows + TTE_COLD_DISTANCE;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // Going down to 7/8 of it so it's not done again right away.
+    for (ssize_t looked = 0; looked < ec.num_rows && ec.slabs.live > cd -> budget / 8 * 7;) {
+        if (cd -> next_y >= ec.num_rows)
+            cd -> next_y = 0;
+        ssize_t from = cd -> next_y - cd -> next_y % TTE_COLD_ROWS;
+        ssize_t to = from + TTE_COLD_ROWS < ec.num_rows ? from + TTE_COLD_ROWS : ec.num_rows;
+        cd -> next_y = to;
+        looked += to - from;
+        if (to > near_from && from < near_to)
+            continue;
+        editorFreezeRows(from, to);
+        if (elapsedMs(&start) >= TTE_COLD_SLICE_MS)
+            break;
+    }
+}
+
+// Called while waiting for keypresses. Returns true if something changed
+// and the screen must be refreshed.
+int editorIdle() {
+    int refresh = 0;
+    // Rows are not touched while prompting, the search keeps pointers
+    // into them.
+    if (!ec.in_prompt && !ec.read_only && !ec.loader) {
+        refresh |= editorCheckFile();
+        editorColdSweep();
+        editorCompact();
+        editorMemoryCheck();
+    }
+    return refresh;
+}
+
 /*** Init section ***/
 
 void initEditor() {
@@ -2072,8 +6848,20 @@ void initEditor() {
     ec.col_offset = 0;
     ec.num_rows = 0;
     ec.row = NULL;
+    ec.row_cap = 0;
+    ec.cold.budget = TTE_COLD_BUDGET;
     ec.dirty = 0;
     ec.use_tabs = 0;
+    ec.follow = 0;
+    ec.open_at_end = 0;
+    ec.row_open = 0;
+    ec.file_offset = 0;
+    ec.watch_fd = -1;
+    ec.loader = NULL;
+    ec.in_prompt = 0;
+    ec.read_only = 0;
+    ec.row_base = 0;
+    ec.hl_base_open = 0;
     ec.file_name = NULL;
     ec.extension[0] = '\0';
     ec.status_msg[0] = '\0';
@@ -2098,7 +6886,8 @@ void printHelp() {
     printf("Keybinding    Action\n\n");
     printf("Ctrl-Q        Exit\n");
     printf("Ctrl-S        Save\n");
-    printf("Ctrl-F        Search. Esc, enter and arrows to interact once searching\n");
+    printf("Ctrl-F        Search. Esc, enter and arrows to interact once searching, Ctrl-R for a regex\n");
+    printf("Ctrl-G        Go to a byte offset (or a percentage of the file, like 50%%)\n");
     printf("Ctrl-E        Flip line upwards\n");
     printf("Ctrl-D        Flip line downwards\n");
     printf("Ctrl-C        Copy line\n");
@@ -2114,6 +6903,10 @@ void printHelp() {
     printf("-v | --version                                  Prints the version of tte\n");
     printf("-e | --extension <file_extension> <file_name>   Specify the file extension\n");
     printf("-t | --use-tabs [file_name]                     Use tabs instead of spaces\n");
+    printf("-f | --follow <file_name>                       Load lines appended to the file\n");
+    printf("-R | --read-only <file_name>                    View huge files, paging them in\n");
+    printf("+G | --end <file_name>                          Open the file at its end\n");
+    printf("--max-memory <size> <file_name>                 Stay under size bytes (K, M or G suffix), undo is not counted\n");
 
     printf("\n\nFor now, usage of ISO 8859-1 is recommended.\n");
 }
@@ -2133,6 +6926,48 @@ int handleArgs(int argc, char* argv[]) {
         } else if (strncmp("-t", argv[1], 2) == 0 || strncmp("--use-tabs", argv[1], 10) == 0) {
             ec.use_tabs = 1;
             return argc > 2 ? 2 : 0;
+        } else if (strncmp("-f", argv[1], 2) == 0 || strncmp("--follow", argv[1], 8) == 0) {
+            if (argc > 2) {
+                ec.follow = 1;
+                return 2;
+            } else {
+                printf("[ERROR] You must specify a file name to follow\n");
+                return -1;
+            }
+        } else if (strncmp("+G", argv[1], 2) == 0 || strncmp("--end", argv[1], 5) == 0) {
+            if (argc > 2) {
+                ec.open_at_end = 1;
+                return 2;
+            } else {
+                printf("[ERROR] You must specify a file name to open at its end\n");
+                return -1;
+            }
+        } else if (strncmp("-R", argv[1], 2) == 0 || strncmp("--read-only", argv[1], 11) == 0) {
+            if (argc > 2) {
+                ec.read_only = 1;
+                return 2;
+            } else {
+                printf("[ERROR] You must specify a file name to view\n");
+                return -1;
+            }
+        } else if (strncmp("--max-memory", argv[1], 12) == 0) {
+            char* end;
+            double size = argc > 3 ? strtod(argv[2], &end) : 0;
+            if (size > 0 && (*end == '\0' || strchr("kKmMgG", *end))) {
+                if (*end == 'k' || *end == 'K')
+                    size *= 1 << 10;
+                else if (*end == 'm' || *end == 'M')
+                    size *= 1 << 20;
+                else if (*end == 'g' || *end == 'G')
+                    size *= 1 << 30;
+                ec.max_memory = size;
+                // Rows start being compressed well before the limit.
+                ec.cold.budget = ec.max_memory / 2;
+                return 3;
+            } else {
+                printf("[ERROR] You must specify a size (like 512M or 2G) and a file name\n");
+                return -1;
+            }
         } else if (strncmp("-e", argv[1], 2) == 0 || strncmp("--extension", argv[1], 11) == 0) {
             if (argc > 3) {
                 size_t len = strlen(argv[2]);
@@ -2151,7 +6986,9 @@ int handleArgs(int argc, char* argv[]) {
 int main(int argc, char* argv[]) {
     initEditor();
     int arg_response = handleArgs(argc, argv);
-    if (arg_response > 0)
+    if (arg_response > 0 && ec.read_only)
+        editorPagerOpen(argv[argc - 1]);
+    else if (arg_response > 0)
         editorOpen(argv[argc - 1]);
     else if (arg_response == -1)
         return 0;